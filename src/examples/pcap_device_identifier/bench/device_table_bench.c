@@ -0,0 +1,343 @@
+/*
+  This file is a part of Qosmos Device Identification library
+
+  Copyright Qosmos Tech 2000-2018 - All rights reserved
+
+  This computer program and all its components are protected by
+  authors' rights and copyright law and by international treaties.
+  Any representation, reproduction, distribution or modification
+  of this program or any portion of it is forbidden without
+  Qosmos explicit and written agreement and may result in severe
+  civil and criminal penalties, and will be prosecuted
+  to the maximum extent possible under the law.
+*/
+
+/*
+ * Device table micro-benchmark.
+ *
+ * Compares pdi_device_table_get_entry() with the former table, an array of
+ * 1024 SLIST buckets each protected by a rwlock, for several populations:
+ * - insert: first lookup of each address, which creates the device,
+ * - lookup: lookups of known addresses, in random order, followed like in
+ *   the dispatcher by the identification check and last packet time update.
+ * The population may be given on the command line; beyond a few hundred
+ * thousand devices the former table takes minutes. Run under
+ * "perf stat -e cache-misses" to get the cache misses behind the figures.
+ *
+ * The device identification library is replaced by stubs: only the table
+ * itself is measured.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "qmdevice.h"
+
+#include "pdi_common.h"
+#include "pdi_utils.h"
+
+#include "pdi_device.h"
+
+#define BENCH_LOOKUP_ROUNDS 4
+
+struct opt pdi_options;
+
+/*
+ * Device identification library stubs.
+ */
+struct qmdev_device_context {
+    void *user_handle;
+};
+
+int qmdev_device_context_create(struct qmdev_instance        *instance,
+                                struct qmdev_device_context **device_context)
+{
+    *device_context = calloc(1, sizeof(struct qmdev_device_context));
+
+    return *device_context ? QMDEV_SUCCESS : -1;
+}
+
+int qmdev_device_context_destroy(struct qmdev_device_context *device_context)
+{
+    free(device_context);
+
+    return QMDEV_SUCCESS;
+}
+
+int qmdev_device_context_reset(struct qmdev_device_context *device_context)
+{
+    device_context->user_handle = NULL;
+
+    return QMDEV_SUCCESS;
+}
+
+int qmdev_device_context_user_handle_set(struct qmdev_device_context *device_context,
+                                         void                        *user_handle)
+{
+    device_context->user_handle = user_handle;
+
+    return QMDEV_SUCCESS;
+}
+
+int qmdev_device_context_user_handle_get(struct qmdev_device_context *device_context,
+                                         void                       **user_handle)
+{
+    *user_handle = device_context->user_handle;
+
+    return QMDEV_SUCCESS;
+}
+
+int qmdev_fingerprint_group_destroy(struct qmdev_fingerprint_group *fp_group)
+{
+    return QMDEV_SUCCESS;
+}
+
+int qmdev_fingerprint_group_reset(struct qmdev_fingerprint_group *fp_group)
+{
+    return QMDEV_SUCCESS;
+}
+
+int qmdev_fingerprint_group_device_context_get(struct qmdev_fingerprint_group *fp_group,
+                                               struct qmdev_device_context   **device_context)
+{
+    return -1;
+}
+
+int qmdev_fingerprint_set(struct qmdev_fingerprint_group *fp_group,
+                          unsigned int                    deep_copy,
+                          unsigned int                    proto_id,
+                          unsigned int                    attr_id,
+                          unsigned int                    attr_flags,
+                          unsigned int                    attr_value_len,
+                          const char                     *attr_value)
+{
+    return -1;
+}
+
+int qmdev_device_metadata_get_byid(enum qmdev_metadata_identifier device_metadata_id,
+                                   unsigned int                   device_metadata_value,
+                                   char const                   **device_metadata_str_value,
+                                   unsigned int                  *device_metadata_str_value_len)
+{
+    return -1;
+}
+
+/*
+ * Former device table.
+ */
+#define SLIST_TABLE_HASHSZ (1 << 10)
+
+/* Former device entry: state and lock along with identification details. */
+struct slist_device {
+    SLIST_ENTRY(slist_device) next;
+    uint32_t               ip_addr;
+    uint8_t                state;
+    time_t                 last_seen;
+    pthread_rwlock_t       rwlock;
+    device_ip_t            device;
+};
+
+static SLIST_HEAD(, slist_device) slist_table[SLIST_TABLE_HASHSZ];
+static pthread_rwlock_t slist_table_rwlock[SLIST_TABLE_HASHSZ];
+
+static void slist_table_init(void)
+{
+    int i;
+
+    for (i = 0; i < SLIST_TABLE_HASHSZ; ++i) {
+        SLIST_INIT(&slist_table[i]);
+        pthread_rwlock_init(&slist_table_rwlock[i], NULL);
+    }
+}
+
+static int slist_table_get_entry(uint32_t ip, device_ip_t **device)
+{
+    uint64_t hash_key = __murmur_hash64((uint8_t *) &ip, sizeof(uint32_t)) % SLIST_TABLE_HASHSZ;
+    struct slist_device *entry = NULL;
+    int ret = 0;
+
+    *device = NULL;
+
+    pthread_rwlock_wrlock(&slist_table_rwlock[hash_key]);
+
+    SLIST_FOREACH(entry, &slist_table[hash_key], next) {
+        if (entry->ip_addr == ip) {
+            *device = &entry->device;
+            break;
+        }
+    }
+
+    if (*device == NULL) {
+        entry = calloc(1, sizeof(struct slist_device));
+        if (entry) {
+            pthread_rwlock_init(&entry->rwlock, NULL);
+            qmdev_device_context_create(NULL, &entry->device.device_context);
+            entry->ip_addr = ip;
+            qmdev_device_context_user_handle_set(entry->device.device_context, &entry->device);
+            SLIST_INSERT_HEAD(&slist_table[hash_key], entry, next);
+            *device = &entry->device;
+            ret = 1;
+        }
+    }
+
+    pthread_rwlock_unlock(&slist_table_rwlock[hash_key]);
+
+    return ret;
+}
+
+static int slist_table_dispatch(uint32_t ip, device_ip_t **device)
+{
+    int ret = slist_table_get_entry(ip, device);
+    struct slist_device *entry = NULL;
+
+    if (*device) {
+        entry = (struct slist_device *) ((char *) *device - offsetof(struct slist_device, device));
+        if (!(__atomic_load_n(&entry->state, __ATOMIC_ACQUIRE) & DEVICE_STATE_IDENTIFIED) &&
+            __atomic_load_n(&entry->last_seen, __ATOMIC_RELAXED) != 1) {
+            __atomic_store_n(&entry->last_seen, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    return ret;
+}
+
+static void slist_table_destroy(void)
+{
+    struct slist_device *entry = NULL;
+    int i;
+
+    for (i = 0; i < SLIST_TABLE_HASHSZ; ++i) {
+        while ((entry = SLIST_FIRST(&slist_table[i])) != NULL) {
+            SLIST_REMOVE_HEAD(&slist_table[i], next);
+            qmdev_device_context_destroy(entry->device.device_context);
+            pthread_rwlock_destroy(&entry->rwlock);
+            free(entry);
+        }
+        pthread_rwlock_destroy(&slist_table_rwlock[i]);
+    }
+}
+
+/*
+ * Benchmark.
+ */
+typedef int (*get_entry_fn)(uint32_t ip, device_ip_t **device);
+
+static int table_dispatch(uint32_t ip, device_ip_t **device)
+{
+    int ret = pdi_device_table_get_entry(ip, device);
+
+    if (*device && !pdi_device_is_identified(*device)) {
+        pdi_device_touch(*device, 1);
+    }
+
+    return ret;
+}
+
+static uint64_t bench_rand_state = 0x9e3779b97f4a7c15ull;
+
+static inline uint32_t bench_rand(void)
+{
+    /* xorshift64* */
+    bench_rand_state ^= bench_rand_state >> 12;
+    bench_rand_state ^= bench_rand_state << 25;
+    bench_rand_state ^= bench_rand_state >> 27;
+
+    return (uint32_t) ((bench_rand_state * 0x2545f4914f6cdd1dull) >> 32);
+}
+
+/* return the time per operation, in nanoseconds */
+static double bench_run(get_entry_fn get_entry, const uint32_t *ips, unsigned int nb,
+                        int expected)
+{
+    device_ip_t *device = NULL;
+    uint64_t start = pdi_clock_ns(CLOCK_MONOTONIC);
+    unsigned int i;
+
+    for (i = 0; i < nb; i++) {
+        if (get_entry(ips[i], &device) != expected || device == NULL) {
+            fprintf(stderr, "ERROR: unexpected result for " IP4_FMT "\n", IP4_FMT_ARGS(ips[i]));
+            exit(1);
+        }
+    }
+
+    return (double) (pdi_clock_ns(CLOCK_MONOTONIC) - start) / nb;
+}
+
+static void bench_population(unsigned int nb_devices)
+{
+    uint32_t *ips = malloc(nb_devices * sizeof(uint32_t));
+    uint32_t *lookups = malloc(nb_devices * BENCH_LOOKUP_ROUNDS * sizeof(uint32_t));
+    double slist_insert, slist_lookup, table_insert, table_lookup;
+    unsigned int i;
+
+    if (ips == NULL || lookups == NULL) {
+        fprintf(stderr, "ERROR: can't allocate %u addresses\n", nb_devices);
+        exit(1);
+    }
+
+    /* Distinct addresses in 10.0.0.0/8: multiplying by an odd constant is a
+     * bijection modulo 2^24. */
+    for (i = 0; i < nb_devices; i++) {
+        ips[i] = 0x0a000000u | (((uint32_t) i * 2654435761u) & 0x00ffffffu);
+    }
+    for (i = 0; i < nb_devices * BENCH_LOOKUP_ROUNDS; i++) {
+        lookups[i] = ips[bench_rand() % nb_devices];
+    }
+
+    slist_table_init();
+    slist_insert = bench_run(slist_table_get_entry, ips, nb_devices, 1);
+    slist_lookup = bench_run(slist_table_dispatch, lookups, nb_devices * BENCH_LOOKUP_ROUNDS, 0);
+    slist_table_destroy();
+
+    /* Headroom, so that maintenance does not evict under pressure. */
+    if (pdi_device_table_init(NULL, 2 * nb_devices, &pdi_options) < 0) {
+        exit(1);
+    }
+    table_insert = bench_run(pdi_device_table_get_entry, ips, nb_devices, 1);
+    /* Complete the last resize, as the dispatcher would. */
+    for (i = 0; i < (nb_devices >> 8) + 1; i++) {
+        pdi_device_table_maintain(0);
+    }
+    table_lookup = bench_run(table_dispatch, lookups, nb_devices * BENCH_LOOKUP_ROUNDS, 0);
+    pdi_device_table_destroy();
+
+    printf("%10u %12.1f %12.1f %12.1f %12.1f\n",
+           nb_devices, slist_insert, table_insert, slist_lookup, table_lookup);
+
+    free(lookups);
+    free(ips);
+}
+
+int main(int argc, char *argv[])
+{
+    static const unsigned int populations[] = { 1000, 10000, 100000, 200000 };
+    unsigned int i;
+
+    pdi_options.device_load = DEVICE_LOAD_DEFAULT;
+    pdi_options.device_idle = DEVICE_IDLE_DEFAULT;
+    pdi_options.device_prewarm = 1;
+
+    printf("%10s %12s %12s %12s %12s   (ns per operation)\n",
+           "devices", "insert slist", "insert table", "lookup slist", "lookup table");
+
+    if (argc > 1) {
+        unsigned long nb_devices = strtoul(argv[1], NULL, 0);
+
+        if (nb_devices == 0 || nb_devices > 0x00ffffff) {
+            fprintf(stderr, "usage: %s [number of devices, up to 16777215]\n", argv[0]);
+            return 1;
+        }
+        bench_population(nb_devices);
+        return 0;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(populations); i++) {
+        bench_population(populations[i]);
+    }
+
+    return 0;
+}
@@ -71,22 +71,38 @@ void *device_identification_thread_main(void *arg)
 
     output_header_line(stdout);
     while (1) {
+        struct qmdev_fingerprint_group *pending;
+        uint64_t start;
+
         /* Get data pointer from FIFO. */
         struct qmdev_fingerprint_group *fp_group = thread_fifo_pop(&device_queue);
+        start = pdi_clock_ns(CLOCK_MONOTONIC);
 
-        if (fp_group == THREAD_PAUSE) {
-            thread_synchronise_device();
-            continue;
+        /* Catch up on fingerprints parked while the FIFO was full.
+         * It must be done before reclaiming devices: they may be parked. */
+        while ((pending = pdi_device_overflow_pop()) != NULL) {
+            device_identification_process_fingerprint(pending);
         }
 
-        if (fp_group == NULL) {
+        if (fp_group == THREAD_EPOCH) {
+            /* No thread references retired devices anymore. */
+            pdi_device_reclaim();
+        } else if (fp_group == THREAD_SNAPSHOT) {
+            pdi_device_table_save(pdi_options.device_snapshot);
+        } else if (fp_group == NULL) {
             break;
+        } else if (fp_group != THREAD_OVERFLOW) {
+            device_identification_process_fingerprint(fp_group);
         }
 
-        device_identification_process_fingerprint(fp_group);
+        __atomic_add_fetch(&ctx->stats.busy_ns, pdi_clock_ns(CLOCK_MONOTONIC) - start,
+                           __ATOMIC_RELAXED);
     }
 
-    fprintf(stdout, "Device thread exiting.\n");
+    fprintf(stdout, "Device thread exiting. fingerprint groups queued: %" PRIu64 ", parked: %" PRIu64
+                    ", fingerprints merged: %" PRIu64 ", shed: %" PRIu64 "\n",
+            fp_backlog_stats.queued, fp_backlog_stats.parked,
+            fp_backlog_stats.merged, fp_backlog_stats.shed);
 
     return NULL;
 }
@@ -142,8 +158,8 @@ void device_identification_process_fingerprint(struct qmdev_fingerprint_group *f
         }
 
         char buffer[256];
-        const char *metadata_value[QMDEV_MAX_METADATA_ID];
-        unsigned int metadata_value_id[QMDEV_MAX_METADATA_ID];
+        const char *metadata_value[QMDEV_MAX_METADATA_ID] = { NULL };
+        unsigned int metadata_value_id[QMDEV_MAX_METADATA_ID] = { 0 };
         unsigned int m_length;
         unsigned int m_flags;
         int i;
@@ -162,8 +178,6 @@ void device_identification_process_fingerprint(struct qmdev_fingerprint_group *f
             }
         }
 
-        metadata_to_string(buffer, 256, metadata_value);
-
         unsigned int fp_matched = 0;
         ret = qmdev_device_context_fingerprint_get_count(device_context, 0, 0,
                                        QMDEV_NB_MATCHED_FINGERPRINTS, &fp_matched);
@@ -175,16 +189,20 @@ void device_identification_process_fingerprint(struct qmdev_fingerprint_group *f
          * + the score is above a certain threshold
          * + AND the number of fingerprints successfully matched is above a certain number. */
         if (score >= DEVICE_DEFAULT_SCORE && fp_matched >= FINGERPRINT_MATCHED_COUNT) {
-            pdi_device_set_identified(device_ip_ptr, score, dev_flags, buffer);
+            pdi_device_set_identified(device_ip_ptr, score, dev_flags, metadata_value_id,
+                                      metadata_value[QMDEV_OS_VERSION]);
             num_dev_ided++;
 
             output_identification(stdout, metadata_value, device_ip_ptr, score);
         }
 
-        DBG_PRINTF_1("[device thread] " IP4_FMT " %s: score %u (osv:os:osver:v:m:t:nic) - %s\n",
-                     IP4_FMT_ARGS(ip),
-                     score >= DEVICE_DEFAULT_SCORE ? "identified" : "result",
-                     score, buffer);
+        if (DBG_GET_LEVEL() >= 1) {
+            metadata_to_string(buffer, 256, metadata_value);
+            DBG_PRINTF_1("[device thread] " IP4_FMT " %s: score %u (osv:os:osver:v:m:t:nic) - %s\n",
+                         IP4_FMT_ARGS(ip),
+                         score >= DEVICE_DEFAULT_SCORE ? "identified" : "result",
+                         score, buffer);
+        }
 
         if (score >= DEVICE_DEFAULT_SCORE) {
             /* We are not interested in other results, exit loop. */
@@ -193,7 +211,8 @@ void device_identification_process_fingerprint(struct qmdev_fingerprint_group *f
     }
 
 fpg_destroy:
-    ret = qmdev_fingerprint_group_destroy(fp_group);
+    /* Keep the group for the next fingerprints of the device. */
+    ret = pdi_device_fingerprint_group_put(device_ip_ptr, fp_group);
     if (ret) {
         fprintf(stderr, "[device thread] ERROR, can't destroy fingerprint group. (%d)\n", ret);
     }
@@ -206,7 +225,8 @@ static void output_header_line(FILE *out) {
 static void output_identification(FILE *out, const char *value[], struct device_ip *device_ip_ptr, unsigned int score)
 {
     int i;
-    fprintf(out, "d(%d)\t" IP4_FMT "\t" MAC_FMT, num_dev_ided, IP4_FMT_ARGS(device_ip_ptr->ip_addr), 
+    uint32_t ip_addr = pdi_device_get_ip_addr(device_ip_ptr);
+    fprintf(out, "d(%d)\t" IP4_FMT "\t" MAC_FMT, num_dev_ided, IP4_FMT_ARGS(ip_addr), 
        MAC_FMT_ARGS(device_ip_ptr->mac_addr));
     //   snprintf(device_entry->mac_addr, 32, MAC_FMT, MAC_FMT_ARGS(*client_mac));
     for(i = 0; i < QMDEV_MAX_METADATA_ID; i++) {
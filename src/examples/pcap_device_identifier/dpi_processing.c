@@ -147,11 +147,29 @@ void *dpi_processing_thread_main(void *arg)
     }
 
     while ((pkt = packet_dequeue(ctx)) != NULL) {
-        if (pkt == THREAD_PAUSE) {
-            thread_synchronise();
+        uint64_t start;
+
+        if (pkt == THREAD_EPOCH) {
+            thread_epoch_worker_pass();
             continue;
         }
+
+        if (pkt == THREAD_PARK) {
+            struct qmdpi_result *result;
+
+            /* No more packets for this thread: release its flows. */
+            ctx->device = NULL;
+            while (qmdpi_flow_expire_next(ctx->worker, NULL, &result) == 0) {
+                /* Expire flows. */
+            }
+            DBG_PRINTF_1("[dpi thread %d] parked\n", ctx->thread_id+1);
+            continue;
+        }
+
+        start = pdi_clock_ns(CLOCK_MONOTONIC);
         dpi_process_packet(pkt, ctx);
+        __atomic_add_fetch(&ctx->stats.busy_ns, pdi_clock_ns(CLOCK_MONOTONIC) - start,
+                           __ATOMIC_RELAXED);
     }
 
     struct qmdpi_result *result;
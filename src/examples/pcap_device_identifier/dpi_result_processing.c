@@ -51,11 +51,14 @@ struct pdi_attr_result {
 
 /*
  * The function adds a fingerprint to a group.
- * If the group does not exist, it creates one then adds the attributes.
+ * If the group does not exist and the device has fingerprints parked in its
+ * pending slot, the fingerprint is merged there instead.
+ * Otherwise, it creates a group then adds the attributes.
  * On error, if the fingerprint group was created in this call, the allocated
  * data are destroyed and *fp_group_p is NULL.
+ * return 0 if the fingerprint has been added or merged, -1 otherwise.
  */
-static void dpi_engine_add_fingerprint(struct pdi_thread               *ctx,
+static int dpi_engine_add_fingerprint(struct pdi_thread               *ctx,
                                        device_ip_t                     *device,
                                        struct qmdev_fingerprint_group **fp_group_p,
                                        unsigned int                     deep_copy,
@@ -74,15 +77,34 @@ static void dpi_engine_add_fingerprint(struct pdi_thread               *ctx,
 
     if (device == NULL) {
         fprintf(stderr, "[dpi thread %d] packet %" PRIu64 " ERROR: device is NULL\n", ctx->thread_id+1, ctx->pkt_nb);
-        return ;
+        return -1;
     }
 
+    /* Attached on the first fingerprint of the device. */
     device_context = pdi_device_get_device_context(device);
+    if (device_context == NULL) {
+        /* Identified, or no context left. */
+        return -1;
+    }
 
     if (*fp_group_p == NULL) {
+        ret = pdi_device_fingerprint_merge(device, deep_copy, proto_id, attr_id, attr_flags,
+                                           attr_value_len, attr_value);
+        if (ret == 0) {
+            __atomic_add_fetch(&fp_backlog_stats.merged, 1, __ATOMIC_RELAXED);
+            DBG_PRINTF_2("[dpi thread %d] packet %" PRIu64 " fingerprint merged: " FP_FMT "\n",
+                         ctx->thread_id+1, ctx->pkt_nb, FP_ARGS);
+            return 0;
+        } else if (ret > 0) {
+            __atomic_add_fetch(&fp_backlog_stats.shed, 1, __ATOMIC_RELAXED);
+            return -1;
+        }
+
         created = 1;
 
-        ret = qmdev_fingerprint_group_create(device_context, fp_group_p);
+        /* Reuse the group of the previous fingerprints of the device. */
+        *fp_group_p = pdi_device_fingerprint_group_get(device);
+        ret = *fp_group_p ? QMDEV_SUCCESS : qmdev_fingerprint_group_create(device_context, fp_group_p);
         if (ret) {
             fprintf(stderr, "[dpi thread %d] packet %" PRIu64 " ERROR: Can't create fingerprint group (%d) " FP_FMT "\n",
                             ctx->thread_id+1, ctx->pkt_nb, ret, FP_ARGS);
@@ -102,19 +124,23 @@ static void dpi_engine_add_fingerprint(struct pdi_thread               *ctx,
         }
         fprintf(stderr, "[dpi thread %d] packet %" PRIu64 " ERROR: Can't set fingerprint (%d) " FP_FMT "\n",
                         ctx->thread_id+1, ctx->pkt_nb, ret, FP_ARGS);
+        return -1;
     }
+    ctx->fp_nb++;
 
     /* All went well. */
     DBG_PRINTF_2("[dpi thread %d] packet %" PRIu64 " fingerprint added: " FP_FMT "\n",
                  ctx->thread_id+1, ctx->pkt_nb, FP_ARGS);
     fflush(stdout);
+
+    return 0;
 }
 
 /* For DHCP: we need to extract:
  * + message type DHCP REQUEST
  *   - chaddr
  *   - host name
- *   - option 50: requested IP address (to create new device)
+ *   - option 50: requested IP address (to create new device, if in scope)
  *   - option 55: parameter request list
  *   - option 60: vendor class indentifier
  */
@@ -172,28 +198,19 @@ static int dpi_engine_handle_dhcp(struct pdi_thread      *ctx,
     while(qmdpi_result_attr_getnext(result, &attr->proto_id, &attr->id,
                                     &attr->value, &attr->value_len, &attr->flags) == 0);
 
-    /* We have saved the attributes we were interested in, now use them. */
-    if (message_type == DHCP_MESSAGE_REQUEST && ip_addr) {
-
-        /* Check if we need to create a new device. */
-        int new_device = 0;
-        device_ip_t *device_entry_tmp = *device_entry_p;
-        new_device = pdi_device_table_get_entry(ip_addr, device_entry_p);
+    /* We have saved the attributes we were interested in, now use them.
+     * The dispatcher has already looked the requested address device up:
+     * there is none if it is out of scope or known. */
+    if (message_type == DHCP_MESSAGE_REQUEST && ip_addr && *device_entry_p) {
 
-        if (*device_entry_p == NULL) {
-            fprintf(stderr, "[dpi thread %d] packet %" PRIu64 " ERROR: no more device available\n",
-                    ctx->thread_id+1, ctx->pkt_nb);
-            return 0;
-        }
-
-        if (device_entry_tmp && device_entry_tmp != *device_entry_p) {
+        if (pdi_device_get_ip_addr(*device_entry_p) != ip_addr) {
             fprintf(stderr, "[dpi thread %d] packet %" PRIu64 " WARNING: something is odd %d %s\n",
                     ctx->thread_id+1, ctx->pkt_nb, __LINE__, __FILE__);
             return 0;
         }
 
-        DBG_PRINTF_2("[dpi thread %d] packet %" PRIu64 " DHCPREQ %d - %u - " IP4_FMT " " MAC_FMT  " \n",
-                     ctx->thread_id+1, ctx->pkt_nb, new_device, num_options, IP4_FMT_ARGS(ip_addr), MAC_FMT_ARGS(mac));
+        DBG_PRINTF_2("[dpi thread %d] packet %" PRIu64 " DHCPREQ %u - " IP4_FMT " " MAC_FMT  " \n",
+                     ctx->thread_id+1, ctx->pkt_nb, num_options, IP4_FMT_ARGS(ip_addr), MAC_FMT_ARGS(mac));
 
         int i;
         for(i = 0; i < num_options; i++) {
@@ -223,12 +240,16 @@ void dpi_engine_process_result(struct pdi_thread   *ctx,
     device_ip_t *device_entry = ctx->device;
     struct qmdev_fingerprint_group *fp_group = NULL;
     struct pdi_attr_result attr;
+    uint8_t mac[6];
     int dhcp_seen = 0;
+    int mac_added = 0;
 
     if (f == NULL || result_flags == NULL) {
         return;
     }
 
+    ctx->fp_nb = 0;
+
     /* device_entry may be NULL in case of DHCP. */
     if (device_entry && !QMDPI_RESULT_FLAGS_FLOW_EXPIRED(result_flags)) {
         dpi_handle_tcp(ctx, device_entry, &fp_group, result, &attr);
@@ -241,22 +262,36 @@ void dpi_engine_process_result(struct pdi_thread   *ctx,
             dhcp_seen = 1;
             dpi_engine_handle_dhcp(ctx, &device_entry, &fp_group, result, &attr);
             /* note: device_entry may be NULL here. */
+        } else if (__atomic_load_n(&pdi_governor_level, __ATOMIC_RELAXED) >= GOVERNOR_LEVEL_NO_USER_AGENT) {
+            /* Apart from DHCP, only User-Agent attributes are registered,
+             * see attributes[]: skip them under load. */
+            continue;
         } else {
             dpi_engine_add_fingerprint(ctx, device_entry, &fp_group, QMDEV_DEEP_COPY,
                                        attr.proto_id, attr.id, attr.flags, attr.value_len, attr.value);
         }
     }
 
-    /* Send mac address only once: if no dhcp or if ethernet mac has not been sent. */
-    if (device_entry && (!dhcp_seen && !pdi_device_fetch_and_set_mac_flag(device_entry))) {
-        dpi_engine_add_fingerprint(ctx, device_entry, &fp_group, QMDEV_DEEP_COPY,
-                                   Q_PROTO_ETH, Q_ETH_ADDRESS, 0, 6, (const char *) &ctx->wdata[6]);
+    /* Send mac address only once: if no dhcp and once the dispatcher has
+     * learnt it, see pdi_mac.c. The source of the frame is a router's for
+     * routed packets. */
+    if (device_entry && !dhcp_seen && pdi_device_fetch_mac(device_entry, mac)) {
+        mac_added = dpi_engine_add_fingerprint(ctx, device_entry, &fp_group, QMDEV_DEEP_COPY,
+                                               Q_PROTO_ETH, Q_ETH_ADDRESS, 0, 6,
+                                               (const char *) mac) == 0;
     }
 
     if (fp_group != NULL) {
         /* process fp: send to device thread.
          * fp_group will be destroyed in the processing thread. */
-        thread_fingerprint_queue(fp_group);
+        if (thread_fingerprint_queue(ctx, fp_group) < 0) {
+            mac_added = 0;
+        }
+    }
+
+    /* Only once it reached the device thread: it is sent again otherwise. */
+    if (mac_added) {
+        pdi_device_mac_sent(device_entry);
     }
 
     return ;
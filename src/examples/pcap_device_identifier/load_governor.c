@@ -0,0 +1,276 @@
+/*
+  This file is a part of Qosmos Device Identification library
+
+  Copyright Qosmos Tech 2000-2018 - All rights reserved
+
+  This computer program and all its components are protected by
+  authors' rights and copyright law and by international treaties.
+  Any representation, reproduction, distribution or modification
+  of this program or any portion of it is forbidden without
+  Qosmos explicit and written agreement and may result in severe
+  civil and criminal penalties, and will be prosecuted
+  to the maximum extent possible under the law.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "pdi_common.h"
+#include "pdi_utils.h"
+
+/*
+ * Load governor.
+ *
+ * The dispatcher thread samples the pipeline load every GOVERNOR_PERIOD_NS:
+ * - fill level of DPI thread rings, priority lanes included, and of the
+ *   device queue,
+ * - busy time of the dispatcher, DPI threads and device thread.
+ * The load is the highest of these percentages.
+ *
+ * When the load reaches the high threshold, the governor first starts one
+ * more DPI thread if --dpi_thread_max allows it, then steps down one
+ * degradation level (see GOVERNOR_LEVEL_*). Once the load stayed below the
+ * low threshold for GOVERNOR_STABLE_SAMPLES samples, it steps back up one
+ * level, then removes DPI threads down to --dpi_thread.
+ *
+ * Limitation: governor_tick() is called as packet time moves and on live
+ * capture timeouts, but busy times are measured against wall time, and the
+ * dispatcher load is its CPU time. This fits live captures. On offline
+ * replays (--degrade), packet time and wall time diverge, so samples come
+ * irregularly; and on both, time the dispatcher spends blocked, in
+ * pcap_next_ex() for instance, reads as idle: only the ring fill then
+ * shows a saturated pipeline.
+ */
+
+#define GOVERNOR_PERIOD_NS        500000000ull /* 500 ms */
+#define GOVERNOR_STABLE_SAMPLES   4
+
+static const char *governor_level_string[GOVERNOR_LEVEL_MAX + 1] = {
+    [GOVERNOR_LEVEL_NORMAL]        = "normal",
+    [GOVERNOR_LEVEL_NO_BULK_DPI]   = "no bulk DPI",
+    [GOVERNOR_LEVEL_NO_USER_AGENT] = "no User-Agent",
+    [GOVERNOR_LEVEL_SYN_DHCP_ONLY] = "DHCP and SYN only",
+};
+
+/* Current level, read by dispatcher and DPI threads. */
+int pdi_governor_level = GOVERNOR_LEVEL_NORMAL;
+
+static struct {
+    int           max_level;
+    unsigned int  high;
+    unsigned int  low;
+    unsigned int  nb_workers;
+    unsigned int  min_workers;
+    unsigned int  low_samples;
+    uint64_t      last_ns;
+    uint64_t      last_dispatch_cpu_ns;
+    uint64_t      last_device_busy_ns;
+    uint64_t     *last_dpi_busy_ns;
+    uint64_t      steps_down;
+    uint64_t      steps_up;
+    uint64_t      workers_added;
+    uint64_t      workers_removed;
+    uint64_t      entered[GOVERNOR_LEVEL_MAX + 1];
+} governor;
+
+void governor_init(struct opt *opt)
+{
+    memset(&governor, 0, sizeof(governor));
+
+    /* Shedding packets read from a file would only lose information:
+     * by default the governor only runs on live captures. */
+    if (opt->degrade < 0) {
+        governor.max_level = opt->live ? GOVERNOR_LEVEL_MAX : GOVERNOR_LEVEL_NORMAL;
+    } else if (opt->degrade > GOVERNOR_LEVEL_MAX) {
+        governor.max_level = GOVERNOR_LEVEL_MAX;
+    } else {
+        governor.max_level = opt->degrade;
+    }
+
+    governor.high = opt->degrade_high;
+    governor.low = opt->degrade_low;
+    governor.nb_workers = opt->num_dpi_workers_max;
+    governor.min_workers = opt->num_dpi_workers;
+    governor.entered[GOVERNOR_LEVEL_NORMAL] = 1;
+
+    if (governor.max_level == GOVERNOR_LEVEL_NORMAL &&
+        governor.nb_workers == governor.min_workers) {
+        return;
+    }
+
+    governor.last_dpi_busy_ns = calloc(governor.nb_workers, sizeof(*governor.last_dpi_busy_ns));
+    if (governor.last_dpi_busy_ns == NULL) {
+        fprintf(stderr, "ERROR: can't allocate load governor, disabled\n");
+        governor.max_level = GOVERNOR_LEVEL_NORMAL;
+        return;
+    }
+
+    governor.last_ns = pdi_clock_ns(CLOCK_MONOTONIC);
+    governor.last_dispatch_cpu_ns = pdi_clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    governor.last_device_busy_ns = thread_device_busy_get();
+
+    fprintf(stdout, "Load governor: max level %d (%s), DPI threads %u-%u, thresholds %u%%/%u%%\n",
+            governor.max_level, governor_level_string[governor.max_level],
+            governor.min_workers, governor.nb_workers, governor.high, governor.low);
+}
+
+static void governor_set_workers(unsigned int nb_active, unsigned int load)
+{
+    unsigned int previous = thread_workers_active();
+
+    thread_workers_resize(nb_active);
+    if (nb_active > previous) {
+        governor.workers_added++;
+    } else {
+        governor.workers_removed++;
+    }
+
+    fprintf(stderr, "[dispatch thread] governor: DPI threads %u -> %u, load %u%%\n",
+            previous, nb_active, load);
+}
+
+static inline unsigned int governor_percent(uint64_t value, uint64_t total)
+{
+    return total ? (unsigned int) (value * 100 / total) : 0;
+}
+
+static void governor_set_level(int level, unsigned int load, unsigned int ring,
+                               unsigned int dispatch, unsigned int dpi, unsigned int device)
+{
+    int previous = pdi_governor_level;
+
+    if (level > previous) {
+        governor.steps_down++;
+    } else {
+        governor.steps_up++;
+    }
+    governor.entered[level]++;
+
+    __atomic_store_n(&pdi_governor_level, level, __ATOMIC_RELAXED);
+
+    fprintf(stderr, "[dispatch thread] governor: level %d (%s) -> %d (%s), load %u%%"
+                    " (rings %u%%, dispatch %u%%, dpi %u%%, device %u%%)\n",
+            previous, governor_level_string[previous],
+            level, governor_level_string[level],
+            load, ring, dispatch, dpi, device);
+}
+
+/*
+ * Sample the pipeline load and adjust the degradation level.
+ *
+ * The function MUST be called from the packet dispatcher thread.
+ */
+void governor_tick(void)
+{
+    uint64_t now;
+    uint64_t elapsed;
+    uint64_t value;
+    unsigned int i;
+    unsigned int ring = 0;
+    unsigned int dpi = 0;
+    unsigned int dispatch;
+    unsigned int device;
+    unsigned int load;
+
+    if (governor.last_dpi_busy_ns == NULL) {
+        return;
+    }
+
+    now = pdi_clock_ns(CLOCK_MONOTONIC);
+    elapsed = now - governor.last_ns;
+    if (elapsed < GOVERNOR_PERIOD_NS) {
+        return;
+    }
+    governor.last_ns = now;
+
+    for (i = 0; i < governor.nb_workers; i++) {
+        struct pdi_thread *th = &threads[i];
+        unsigned int fill;
+
+        fill = governor_percent(PACKET_INDEX(th->write_index - th->read_index), PACKET_QUEUESZ);
+        if (fill > ring) {
+            ring = fill;
+        }
+        fill = governor_percent(PRIO_INDEX(th->prio_write_index - th->prio_read_index),
+                                PRIO_QUEUESZ);
+        if (fill > ring) {
+            ring = fill;
+        }
+
+        value = __atomic_load_n(&th->stats.busy_ns, __ATOMIC_RELAXED);
+        fill = governor_percent(value - governor.last_dpi_busy_ns[i], elapsed);
+        governor.last_dpi_busy_ns[i] = value;
+        if (fill > dpi) {
+            dpi = fill;
+        }
+    }
+
+    value = governor_percent(thread_fifo_depth(&device_queue), FIFO_QUEUESZ);
+    if (value > ring) {
+        ring = value;
+    }
+
+    value = pdi_clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    dispatch = governor_percent(value - governor.last_dispatch_cpu_ns, elapsed);
+    governor.last_dispatch_cpu_ns = value;
+
+    value = thread_device_busy_get();
+    device = governor_percent(value - governor.last_device_busy_ns, elapsed);
+    governor.last_device_busy_ns = value;
+
+    load = ring;
+    if (dispatch > load) {
+        load = dispatch;
+    }
+    if (dpi > load) {
+        load = dpi;
+    }
+    if (device > load) {
+        load = device;
+    }
+
+    if (load >= governor.high) {
+        governor.low_samples = 0;
+        if (thread_workers_active() < governor.nb_workers) {
+            governor_set_workers(thread_workers_active() + 1, load);
+        } else if (pdi_governor_level < governor.max_level) {
+            governor_set_level(pdi_governor_level + 1, load, ring, dispatch, dpi, device);
+        }
+    } else if (load < governor.low) {
+        if (++governor.low_samples >= GOVERNOR_STABLE_SAMPLES) {
+            governor.low_samples = 0;
+            if (pdi_governor_level > GOVERNOR_LEVEL_NORMAL) {
+                governor_set_level(pdi_governor_level - 1, load, ring, dispatch, dpi, device);
+            } else if (thread_workers_active() > governor.min_workers) {
+                governor_set_workers(thread_workers_active() - 1, load);
+            }
+        }
+    } else {
+        governor.low_samples = 0;
+    }
+
+    thread_workers_drain();
+}
+
+void governor_report(void)
+{
+    int i;
+
+    if (governor.last_dpi_busy_ns == NULL) {
+        return;
+    }
+
+    printf("Load governor: level %d, steps down: %" PRIu64 ", steps up: %" PRIu64
+           ", DPI threads %u, added: %" PRIu64 ", removed: %" PRIu64,
+           pdi_governor_level, governor.steps_down, governor.steps_up,
+           thread_workers_active(), governor.workers_added, governor.workers_removed);
+    for (i = 0; i <= governor.max_level; i++) {
+        printf(", %s: %" PRIu64, governor_level_string[i], governor.entered[i]);
+    }
+    printf("\n");
+
+    free(governor.last_dpi_busy_ns);
+    governor.last_dpi_busy_ns = NULL;
+}
@@ -16,6 +16,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <limits.h>
 
 #include <pcap.h>
 
@@ -43,6 +44,12 @@ uint32_t num_dev_ided = 0;
 
 static struct qmdev_instance *qmdev_instance;
 #define BUFFER_SIZE 1024
+
+/*
+ * Live capture read timeout: the dispatcher must get control back when
+ * traffic stops, for the load governor to notice.
+ */
+#define PCAP_TIMEOUT_MS 100
 static char buffer[BUFFER_SIZE];
 
 static pcap_t *pcap_trace_open(const char *filename);
@@ -52,6 +59,8 @@ static pcap_t *pcap_interface_open(const char *net_if);
 
 static char *dpi_get_config(struct opt *opt);
 static char *dev_get_config(struct opt *opt);
+static unsigned int dev_get_nb_devices(struct opt *opt);
+static unsigned int dev_get_max_devices(struct opt *opt);
 
 static int app_init(struct opt *param);
 static void app_exit(struct opt *param);
@@ -103,6 +112,9 @@ int main(int argc, char *argv[])
     if (!pdi_options.num_dpi_workers) {
         pdi_options.num_dpi_workers = NUM_DPI_WORKERS_DEFAULT;
     }
+    if (pdi_options.num_dpi_workers_max < pdi_options.num_dpi_workers) {
+        pdi_options.num_dpi_workers_max = pdi_options.num_dpi_workers;
+    }
 
     install_sig_handler();
 
@@ -111,11 +123,14 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    ret = thread_launch(pdi_options.num_dpi_workers, dpi_engine_get());
+    ret = thread_launch(pdi_options.num_dpi_workers_max, pdi_options.num_dpi_workers,
+                        dpi_engine_get());
     if (ret < 0) {
         return 1;
     }
 
+    governor_init(&pdi_options);
+
     if (pdi_options.live) {
         pcap = pcap_interface_open(pdi_options.pcaps[0]);
     } else {
@@ -135,6 +150,11 @@ int main(int argc, char *argv[])
             /* Open next pcap */
             pcap = pcap_trace_get_next(&pdi_options);
 
+            /* Devices are removed between traces: save those of the last one. */
+            if (pdi_options.device_snapshot && (pcap == NULL || !pdi_loop)) {
+                pdi_device_table_save(pdi_options.device_snapshot);
+            }
+
             /* Clean up few things. */
             remove_devices();
             num_dev_ided = 0;
@@ -142,8 +162,19 @@ int main(int argc, char *argv[])
         }
     }
 
-    thread_stop(pdi_options.num_dpi_workers);
-    thread_wait(pdi_options.num_dpi_workers);
+    if (pdi_options.live && pdi_options.device_snapshot) {
+        pdi_device_table_save(pdi_options.device_snapshot);
+    }
+
+    governor_report();
+    pdi_device_table_report();
+    inventory_report();
+    admission_report();
+    lease_report();
+    mac_report();
+
+    thread_stop(pdi_options.num_dpi_workers_max);
+    thread_wait(pdi_options.num_dpi_workers_max);
 
     app_exit(&pdi_options);
 
@@ -159,7 +190,7 @@ static int app_init(struct opt *param)
     unsigned int i;
     unsigned int num_threads;
 
-    num_threads = param->num_dpi_workers ? param->num_dpi_workers : 1;
+    num_threads = param->num_dpi_workers_max ? param->num_dpi_workers_max : 1;
 
     threads = (struct pdi_thread *) malloc(num_threads * sizeof(*threads));
     if (threads == NULL) {
@@ -204,8 +235,61 @@ static int app_init(struct opt *param)
         }
     }
 
+    /* Build the scope of addresses devices may be created for, and the
+     * rate they may be created at. */
+    ret = scope_init(param->monitor, param->exclude);
+    if (ret == 0 && (ret = admission_init(param)) < 0) {
+        scope_exit();
+    }
+    if (ret == 0 && (ret = lease_init()) < 0) {
+        admission_exit();
+        scope_exit();
+    }
+    if (ret == 0 && (ret = mac_init()) < 0) {
+        lease_exit();
+        admission_exit();
+        scope_exit();
+    }
+    if (ret < 0) {
+        if (dump_file) {
+            fclose(dump_file);
+            dump_file = NULL;
+        }
+        goto exit_dev;
+    }
+
     /* Init devices table. */
-    pdi_device_table_init(qmdev_instance);
+    ret = pdi_device_table_init(qmdev_instance, dev_get_max_devices(param), param);
+    if (ret < 0) {
+        mac_exit();
+        lease_exit();
+        admission_exit();
+        scope_exit();
+        if (dump_file) {
+            fclose(dump_file);
+            dump_file = NULL;
+        }
+        goto exit_dev;
+    }
+
+    /* Restore devices identified by a previous run. */
+    if (param->device_snapshot) {
+        pdi_device_table_load(param->device_snapshot);
+    }
+
+    /* Load known devices. */
+    if (param->inventory && inventory_load(param->inventory) < 0) {
+        pdi_device_table_destroy();
+        mac_exit();
+        lease_exit();
+        admission_exit();
+        scope_exit();
+        if (dump_file) {
+            fclose(dump_file);
+            dump_file = NULL;
+        }
+        goto exit_dev;
+    }
 
     /* Init device FIFO queue. */
     thread_fifo_init(&device_queue);
@@ -226,7 +310,7 @@ exit_th:
 static void app_exit(struct opt *param)
 {
     int i;
-    unsigned int nb_workers = param->num_dpi_workers;
+    unsigned int nb_workers = param->num_dpi_workers_max;
 
     if (!nb_workers) {
         /* There is at least a thread context and a DPI worker. */
@@ -243,6 +327,11 @@ static void app_exit(struct opt *param)
     dpi_engine_exit();
 
     pdi_device_table_destroy();
+    inventory_exit();
+    mac_exit();
+    lease_exit();
+    admission_exit();
+    scope_exit();
 
     qmdev_instance_destroy(qmdev_instance);
     qmdev_instance = NULL;
@@ -308,7 +397,7 @@ static pcap_t *pcap_interface_open(const char *net_if)
     /* open interface */
     if (net_if) {
         fprintf(stdout, "pcap_open_live: %s\n", net_if);
-        pcap = pcap_open_live(net_if, 65535, 1, 0, errbuf);
+        pcap = pcap_open_live(net_if, 65535, 1, PCAP_TIMEOUT_MS, errbuf);
 
     } else {
         /* check for a default interface */
@@ -318,7 +407,7 @@ static pcap_t *pcap_interface_open(const char *net_if)
             return NULL;
         }
         fprintf(stdout, "Opening interface %s\n", dev);
-        pcap = pcap_open_live(dev, 65535, 1, 0, errbuf);
+        pcap = pcap_open_live(dev, 65535, 1, PCAP_TIMEOUT_MS, errbuf);
     }
 
     if (!pcap) {
@@ -348,8 +437,8 @@ static char *dpi_get_config(struct opt *opt)
     if (!opt->dpi_cs.nb) {
         unsigned int num_workers = 1;
 
-        if (opt->num_dpi_workers) {
-            num_workers = opt->num_dpi_workers;
+        if (opt->num_dpi_workers_max) {
+            num_workers = opt->num_dpi_workers_max;
         }
 
         snprintf(buffer + pos, BUFFER_SIZE - pos, "nb_workers=%d;nb_flows=%d",
@@ -381,3 +470,34 @@ static char *dev_get_config(struct opt *opt)
     printf("device ID library config: %s\n", buffer);
     return buffer;
 }
+
+/* Number of device contexts the device ID library is configured for. */
+static unsigned int dev_get_nb_devices(struct opt *opt)
+{
+    size_t i;
+
+    for (i = 0; i < opt->dev_cs.nb; i++) {
+        if (strcmp(opt->dev_cs.config[i].key, "nb_device_contexts") == 0) {
+            return opt->dev_cs.config[i].value;
+        }
+    }
+
+    return NUM_DEVICES_DEFAULT;
+}
+
+/*
+ * Devices only hold a device context once they send fingerprints: by
+ * default, track several devices per context.
+ */
+static unsigned int dev_get_max_devices(struct opt *opt)
+{
+    uint64_t nb;
+
+    if (opt->device_max) {
+        return opt->device_max;
+    }
+
+    nb = (uint64_t) dev_get_nb_devices(opt) * DEVICE_ENTRIES_PER_CONTEXT;
+
+    return nb > UINT_MAX ? UINT_MAX : (unsigned int) nb;
+}
@@ -36,6 +36,52 @@
 #define LOOP_HEADER_SZ 4
 #define LLC_HEADER_SZ 2
 
+/* Packet classes, see packet_classify() */
+#define PACKET_CLASS_BULK     0
+#define PACKET_CLASS_PAYLOAD  1 /* first payload packets of a TCP connection */
+#define PACKET_CLASS_SYN      2
+#define PACKET_CLASS_DHCP     3
+
+/* Number of TCP payload packets sent in the priority lane after a SYN. */
+#define PRIO_PAYLOAD_PACKETS 4
+
+#define ETHERTYPE_NUM_ARP 0x0806
+
+/* ARP for IPv4 over Ethernet */
+#define ARP_IPV4_LEN     28
+#define ARP_SENDER_MAC    8
+#define ARP_SENDER_IP    14
+
+#define IPPROTO_NUM_TCP   6
+#define IPPROTO_NUM_UDP  17
+#define DHCP_SERVER_PORT 67
+#define DHCP_CLIENT_PORT 68
+
+/* Ports below are those of services, see packet_service_port(). */
+#define SERVICE_PORT_MAX 1024
+
+/* BOOTP fixed fields, then the DHCP magic cookie and options. */
+#define DHCP_CIADDR_OFFSET           12
+#define DHCP_YIADDR_OFFSET           16
+#define DHCP_CHADDR_OFFSET           28
+#define DHCP_OPTIONS_OFFSET         240
+#define DHCP_HTYPE_ETHERNET           1
+#define DHCP_OPTION_PAD               0
+#define DHCP_OPTION_REQUESTED_IP     50
+#define DHCP_OPTION_MESSAGE_TYPE     53
+#define DHCP_OPTION_END             255
+#define DHCP_MESSAGE_REQUEST          3
+#define DHCP_MESSAGE_ACK              5
+
+/* Check for retired devices to reclaim every EPOCH_PACKET_INTERVAL packets. */
+#define EPOCH_PACKET_INTERVAL (1 << 10)
+
+/*
+ * Let the load governor sample the load whenever packet time moved by
+ * GOVERNOR_CHECK_USEC, or the capture timed out: it has its own period.
+ */
+#define GOVERNOR_CHECK_USEC   100000
+
 /*
  * Global packet number
  */
@@ -47,6 +93,37 @@ static uint64_t packet_number;
 static uint64_t packet_dropped;
 static uint64_t packet_filtered;
 
+/*
+ * Packets of addresses out of the monitored scope, dispatched without device
+ */
+static uint64_t packet_unmonitored;
+
+/*
+ * Packets sent by the server side of their flow, dispatched without device
+ */
+static uint64_t packet_server_side;
+
+/*
+ * Packets queued in DPI threads priority lane
+ */
+static uint64_t packet_prio;
+
+/*
+ * Packets not sent to DPI because of the load governor
+ */
+static uint64_t packet_shed;
+
+/*
+ * Payload packets of each flow bucket still to be sent in the priority lane
+ */
+static uint8_t flow_prio_payload[FLOW_LANE_HASHSZ];
+
+/*
+ * Address of the side that sent the SYN of the last TCP connection of each
+ * flow bucket, network byte order, 0 if none
+ */
+static uint32_t flow_client[FLOW_LANE_HASHSZ];
+
 static struct pdi_pkt *packet_filter_and_build(const struct pcap_pkthdr *phdr,
        const u_char *pdata, int link_mode, int remove_llc, int link_mode_loop, int* vlan_tag);
 
@@ -130,15 +207,262 @@ static int packet_act_on_device(device_ip_t *device)
 }
 
 
+/*
+ * DHCP message fields the dispatcher tracks devices with.
+ */
+struct packet_dhcp {
+    int         message_type;
+    uint32_t    ciaddr;         /* network byte order */
+    uint32_t    yiaddr;
+    uint32_t    requested;      /* option 50 */
+    uint8_t    *chaddr;         /* NULL unless an Ethernet address */
+};
+
+/*
+ * The function parses a DHCP message from a client, a server or a relay.
+ * return 1 if the packet is a DHCP message, 0 otherwise.
+ */
+static int packet_dhcp_parse(struct pdi_pkt *packet, int link_mode, int vlan_tag,
+                             struct packet_dhcp *dhcp)
+{
+    uint8_t *ip = packet->data;
+    int32_t len = packet->len;
+    uint16_t sport, dport;
+    unsigned int ihl;
+    uint8_t *bootp;
+    uint8_t *option;
+    uint8_t *end;
+
+    if (link_mode == QMDPI_PROTO_ETH) {
+        unsigned int offset = vlan_tag ? 18 : 14;
+
+        ip += offset;
+        len -= offset;
+    }
+
+    if (len < 20 || ip[9] != IPPROTO_NUM_UDP || ((ip[6] & 0x1f) << 8 | ip[7]) != 0) {
+        return 0;
+    }
+
+    ihl = (ip[0] & 0x0f) << 2;
+    if (len < ihl + 8 + DHCP_OPTIONS_OFFSET) {
+        return 0;
+    }
+
+    sport = (ip[ihl] << 8) | ip[ihl + 1];
+    dport = (ip[ihl + 2] << 8) | ip[ihl + 3];
+    if ((sport != DHCP_CLIENT_PORT && sport != DHCP_SERVER_PORT) ||
+        (dport != DHCP_CLIENT_PORT && dport != DHCP_SERVER_PORT)) {
+        return 0;
+    }
+
+    memset(dhcp, 0, sizeof(*dhcp));
+    bootp = ip + ihl + 8;
+    memcpy(&dhcp->ciaddr, &bootp[DHCP_CIADDR_OFFSET], 4);
+    memcpy(&dhcp->yiaddr, &bootp[DHCP_YIADDR_OFFSET], 4);
+    if (bootp[1] == DHCP_HTYPE_ETHERNET && bootp[2] == 6) {
+        dhcp->chaddr = &bootp[DHCP_CHADDR_OFFSET];
+    }
+
+    option = bootp + DHCP_OPTIONS_OFFSET;
+    end = ip + len;
+    while (option < end && *option != DHCP_OPTION_END) {
+        if (*option == DHCP_OPTION_PAD) {
+            option++;
+            continue;
+        }
+        if (option + 2 > end || option + 2 + option[1] > end) {
+            break;
+        }
+        if (option[0] == DHCP_OPTION_MESSAGE_TYPE && option[1] == 1) {
+            dhcp->message_type = option[2];
+        } else if (option[0] == DHCP_OPTION_REQUESTED_IP && option[1] == 4) {
+            memcpy(&dhcp->requested, &option[2], 4);
+        }
+        option += 2 + option[1];
+    }
+
+    return 1;
+}
+
+/*
+ * return the address a DHCP message binds to its client, in network byte
+ * order: the one a DHCPREQUEST asks for or renews, the one a DHCPACK
+ * grants. 0 for other messages.
+ */
+static inline uint32_t packet_dhcp_bound_addr(const struct packet_dhcp *dhcp)
+{
+    if (dhcp->message_type == DHCP_MESSAGE_REQUEST) {
+        return dhcp->requested ? dhcp->requested : dhcp->ciaddr;
+    }
+
+    if (dhcp->message_type == DHCP_MESSAGE_ACK) {
+        return dhcp->yiaddr;
+    }
+
+    return 0;
+}
+
+/*
+ * return 1 if port is the one of a service: a well-known port or a
+ * registered one of a common server, 0 otherwise.
+ */
+static inline int packet_service_port(uint16_t port)
+{
+    if (port < SERVICE_PORT_MAX) {
+        return 1;
+    }
+
+    switch (port) {
+        case 1433:  /* MS SQL */
+        case 1521:  /* Oracle */
+        case 1883:  /* MQTT */
+        case 3306:  /* MySQL */
+        case 3389:  /* RDP */
+        case 5432:  /* PostgreSQL */
+        case 5900:  /* VNC */
+        case 8080:  /* HTTP alternate */
+        case 8443:  /* HTTPS alternate */
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/*
+ * The function infers which side of its flow sent the packet:
+ * - TCP: the side that sent the SYN of the connection is the client, the
+ *   one that answers it with a SYN+ACK the server,
+ * - DHCP: the client sends from port 68, servers and relays from port 67,
+ * - otherwise a packet from a service port to a non-service one comes from
+ *   the server.
+ * Connections are remembered per flow bucket: a collision only costs the
+ * port heuristic for the packets of the older connection.
+ * return 1 if the packet comes from the server side, 0 if it comes from the
+ * client side or if the roles are unknown.
+ */
+static int packet_from_server(struct pdi_pkt *packet, int link_mode,
+                              int vlan_tag, uint32_t hashkey)
+{
+    uint8_t *ip = packet->data;
+    int32_t len = packet->len;
+    uint32_t src, dst;
+    uint16_t sport, dport;
+    unsigned int ihl;
+
+    if (link_mode == QMDPI_PROTO_ETH) {
+        unsigned int offset = vlan_tag ? 18 : 14;
+
+        ip += offset;
+        len -= offset;
+    }
+
+    /* Only first fragments have a L4 header. */
+    if (len < 20 || ((ip[6] & 0x1f) << 8 | ip[7]) != 0) {
+        return 0;
+    }
+
+    ihl = (ip[0] & 0x0f) << 2;
+    if ((ip[9] != IPPROTO_NUM_TCP && ip[9] != IPPROTO_NUM_UDP) ||
+        len < ihl + (ip[9] == IPPROTO_NUM_TCP ? 20 : 8)) {
+        return 0;
+    }
+
+    memcpy(&src, &ip[12], 4);
+    memcpy(&dst, &ip[16], 4);
+    sport = (ip[ihl] << 8) | ip[ihl + 1];
+    dport = (ip[ihl + 2] << 8) | ip[ihl + 3];
+
+    if (ip[9] == IPPROTO_NUM_TCP) {
+        uint32_t *client = &flow_client[FLOW_LANE_INDEX(hashkey)];
+        uint8_t flags = ip[ihl + 13] & 0x12;
+
+        /* SYN without ACK, then SYN+ACK */
+        if (flags == 0x02) {
+            *client = src;
+            return 0;
+        }
+        if (flags == 0x12) {
+            *client = dst;
+            return 1;
+        }
+        if (*client && *client == src) {
+            return 0;
+        }
+        if (*client && *client == dst) {
+            return 1;
+        }
+    } else if (sport == DHCP_SERVER_PORT || sport == DHCP_CLIENT_PORT) {
+        return sport == DHCP_SERVER_PORT &&
+               (dport == DHCP_CLIENT_PORT || dport == DHCP_SERVER_PORT);
+    }
+
+    return packet_service_port(sport) && !packet_service_port(dport);
+}
+
+/*
+ * The function checks if an IPv4 packet comes from a host of the local
+ * link: its TTL is still one of the usual initial values, routers decrement
+ * it. Its Ethernet source address is then the one of the sender.
+ * return 1 if the packet was not routed, 0 otherwise.
+ */
+static inline int packet_not_routed(const uint8_t *ip)
+{
+    return ip[8] == 64 || ip[8] == 128 || ip[8] == 255;
+}
+
+/*
+ * The function learns the MAC address of the sender of an ARP request or
+ * reply, at packet time now. ARP probes have no sender address.
+ */
+static void packet_arp_learn(const uint8_t *frame, uint32_t caplen, const struct timeval *now)
+{
+    const uint8_t *arp = frame + 14;
+    uint16_t ethertype;
+    uint32_t sender;
+
+    if (caplen < 18) {
+        return;
+    }
+
+    ethertype = (frame[12] << 8) | frame[13];
+    if (ethertype == 0x8100) {
+        ethertype = (frame[16] << 8) | frame[17];
+        arp += 4;
+    }
+
+    if (ethertype != ETHERTYPE_NUM_ARP || caplen < (arp - frame) + ARP_IPV4_LEN) {
+        return;
+    }
+
+    /* Ethernet hardware type, IPv4 protocol type and their lengths. */
+    if (arp[0] != 0 || arp[1] != 1 || arp[2] != 0x08 || arp[3] != 0 || arp[4] != 6 || arp[5] != 4) {
+        return;
+    }
+
+    memcpy(&sender, &arp[ARP_SENDER_IP], 4);
+    if (sender) {
+        mac_learn(sender, &arp[ARP_SENDER_MAC], 0, now);
+    }
+}
+
 /*
  * The function checks if a device should be created from this packet.
  * It returns the device associated with
- * packet data. (Here we have only IPv4 addresses, others have already been filtered out)
+ * packet data, NULL if the address is out of the monitored scope or if the
+ * packet comes from the server side of its flow, see packet_from_server().
+ * (Here we have only IPv4 addresses, others have already been filtered out)
  *
- * Upon exit *error is set to 1 if an error occurred otherwise 0.
+ * Upon exit *error is set to 1 if an error occurred otherwise 0,
+ * *known is set to 1 if the device is in the inventory or in the identified
+ * device filter otherwise 0,
+ * *refused is set to 1 if the device does not exist and may not be created
+ * yet, see admission_check(), otherwise 0.
  */
-static device_ip_t *packet_check_new_device(struct pdi_pkt *packet, int link_mode, int vlan_tag, int *error)
+static device_ip_t *packet_check_new_device(struct pdi_pkt *packet, int link_mode, int vlan_tag,
+                                            uint32_t hashkey, int *error, int *known, int *refused)
 {
+    static const uint8_t dft_mac[6] = { 0, 0, 0, 0, 0, 0 };
     uint8_t *frame = packet->data;
     device_ip_t *device_entry = NULL;
     int new_device = 0;
@@ -154,14 +478,18 @@ static device_ip_t *packet_check_new_device(struct pdi_pkt *packet, int link_mod
     uint32_t ip_addr;
     uint8_t *client_mac = NULL;
     uint8_t *addr       = NULL;
+    struct packet_dhcp dhcp;
+    int on_link = 0;    /* Ethernet source is the sender, see packet_not_routed() */
 
     *error = 0;
+    *known = 0;
+    *refused = 0;
 
     if (link_mode == QMDPI_PROTO_ETH) {
         client_mac = &frame[6];
         addr       = &frame[14+12+vlan_offset];
+        on_link    = packet_not_routed(&frame[14 + vlan_offset]);
     } else if (link_mode == QMDPI_PROTO_IP) {
-        const uint8_t dft_mac[6] = { 0, 0, 0, 0, 0, 0 };
         client_mac = (uint8_t *) &dft_mac[0]; /* here for debug purposes. */
         addr       = &frame[12];
     } else {
@@ -173,8 +501,66 @@ static device_ip_t *packet_check_new_device(struct pdi_pkt *packet, int link_mod
 
     memcpy(&ip_addr, addr, 4);
 
+    if (packet_dhcp_parse(packet, link_mode, vlan_tag, &dhcp)) {
+        uint32_t bound = packet_dhcp_bound_addr(&dhcp);
+
+        /* A client that changes address keeps its device, see lease_bind(). */
+        if (bound && dhcp.chaddr) {
+            if (scope_match(bound)) {
+                lease_bind(dhcp.chaddr, bound);
+            }
+            mac_learn(bound, dhcp.chaddr, dhcp.message_type == DHCP_MESSAGE_ACK,
+                      &packet->timestamp);
+        }
+
+        /* A client without address gets the device of the address it
+         * requests: devices are only created here, DPI threads never write
+         * the table. */
+        if (ip_addr == 0 && dhcp.message_type == DHCP_MESSAGE_REQUEST) {
+            ip_addr = dhcp.requested;
+        }
+    }
+
+    /* Known devices never reach the device table. The Ethernet source of a
+     * routed packet is a router's: only match it for packets on the link. */
+    if (inventory_match(ip_addr, on_link ? client_mac : NULL) ||
+        pdi_device_filter_match(ip_addr)) {
+        *known = 1;
+        return NULL;
+    }
+
+    /* Out of scope addresses never get a device. Their packets still reach
+     * DPI, flows of monitored devices must be seen in both directions. */
+    if (ip_addr && !scope_match(ip_addr)) {
+        ++packet_unmonitored;
+        DBG_PRINTF_3("[dispatch thread] packet %" PRIu64 " IP: " IP4_FMT " not monitored\n",
+                     packet->packet_number, IP4_FMT_ARGS(ip_addr));
+        return NULL;
+    }
+
+    /* Servers never get a device: what their packets carry describes the
+     * server, and their source MAC address is the one of a router for
+     * remote servers. Their packets still reach DPI, without device. */
+    if (ip_addr && packet_from_server(packet, link_mode, vlan_tag, hashkey)) {
+        ++packet_server_side;
+        DBG_PRINTF_3("[dispatch thread] packet %" PRIu64 " IP: " IP4_FMT " server side\n",
+                     packet->packet_number, IP4_FMT_ARGS(ip_addr));
+        return NULL;
+    }
+
     if (ip_addr) {
-        new_device = pdi_device_table_get_entry(ip_addr, &device_entry);
+        /* Creations are rate limited, lookups of existing devices are not. */
+        device_entry = pdi_device_table_find(ip_addr);
+        if (device_entry == NULL) {
+            /* Addresses a DHCP server bound are spared the global rate,
+             * that a flood of spoofed sources may exhaust, see
+             * pdi_admission.c. */
+            if (!admission_check(ip_addr, &packet->timestamp, mac_acked(ip_addr))) {
+                *refused = 1;
+                return NULL;
+            }
+            new_device = pdi_device_table_get_entry(ip_addr, &device_entry);
+        }
         if (new_device > 0) {
             DBG_PRINTF_1("[dispatch thread] packet %" PRIu64  " New device: " IP4_FMT " (" MAC_FMT ")\n",
                          packet->packet_number,
@@ -188,6 +574,14 @@ static device_ip_t *packet_check_new_device(struct pdi_pkt *packet, int link_mod
             *error = 1;
             return NULL;
         }
+
+        pdi_device_touch(device_entry, packet->timestamp.tv_sec);
+
+        /* Devices get their MAC address from the dispatcher, see pdi_mac.c. */
+        if (link_mode == QMDPI_PROTO_ETH && !pdi_device_has_mac(device_entry) &&
+            (new_device > 0 || on_link)) {
+            mac_attach(device_entry, ip_addr, on_link ? client_mac : NULL);
+        }
     } else {
         DBG_PRINTF_3("[dispatch thread] packet %" PRIu64  " IP: " IP4_FMT " (" MAC_FMT ")\n",
                      packet->packet_number,
@@ -198,6 +592,92 @@ static device_ip_t *packet_check_new_device(struct pdi_pkt *packet, int link_mod
 }
 
 
+/*
+ * The function checks if a packet may carry a fingerprint:
+ * DHCP, TCP SYN and the first payload packets of a TCP connection.
+ * return the PACKET_CLASS_* of the packet.
+ */
+static int packet_classify(struct pdi_pkt *packet, int link_mode,
+                           int vlan_tag, uint32_t hashkey)
+{
+    uint8_t *ip = packet->data;
+    int32_t len = packet->len;
+    unsigned int ihl;
+
+    if (link_mode == QMDPI_PROTO_ETH) {
+        unsigned int offset = vlan_tag ? 18 : 14;
+
+        ip += offset;
+        len -= offset;
+    } else if (link_mode != QMDPI_PROTO_IP) {
+        return 0;
+    }
+
+    if (len < 20) {
+        return PACKET_CLASS_BULK;
+    }
+
+    /* Only first fragments have a L4 header. */
+    if (((ip[6] & 0x1f) << 8 | ip[7]) != 0) {
+        return PACKET_CLASS_BULK;
+    }
+
+    ihl = (ip[0] & 0x0f) << 2;
+    if (len < ihl + 20) {
+        return PACKET_CLASS_BULK;
+    }
+
+    if (ip[9] == IPPROTO_NUM_UDP) {
+        uint16_t sport = (ip[ihl] << 8) | ip[ihl + 1];
+        uint16_t dport = (ip[ihl + 2] << 8) | ip[ihl + 3];
+
+        if ((sport == DHCP_CLIENT_PORT || sport == DHCP_SERVER_PORT) &&
+            (dport == DHCP_CLIENT_PORT || dport == DHCP_SERVER_PORT)) {
+            return PACKET_CLASS_DHCP;
+        }
+    }
+
+    if (ip[9] == IPPROTO_NUM_TCP) {
+        uint8_t *tcp = ip + ihl;
+        uint8_t *budget = &flow_prio_payload[FLOW_LANE_INDEX(hashkey)];
+        unsigned int ip_len = (ip[2] << 8) | ip[3];
+        unsigned int tcp_len = (tcp[12] >> 4) << 2;
+
+        /* SYN without ACK */
+        if ((tcp[13] & 0x12) == 0x02) {
+            *budget = PRIO_PAYLOAD_PACKETS;
+            return PACKET_CLASS_SYN;
+        }
+
+        if (*budget && ip_len > ihl + tcp_len) {
+            --*budget;
+            return PACKET_CLASS_PAYLOAD;
+        }
+    }
+
+    return PACKET_CLASS_BULK;
+}
+
+/*
+ * The function checks if the load governor lets a packet of this class
+ * reach DPI.
+ * return 1 if the packet must be dropped, 0 otherwise.
+ */
+static inline int packet_governor_shed(int packet_class)
+{
+    int level = __atomic_load_n(&pdi_governor_level, __ATOMIC_RELAXED);
+
+    if (level >= GOVERNOR_LEVEL_SYN_DHCP_ONLY) {
+        return packet_class < PACKET_CLASS_SYN;
+    }
+
+    if (level >= GOVERNOR_LEVEL_NO_BULK_DPI) {
+        return packet_class == PACKET_CLASS_BULK;
+    }
+
+    return 0;
+}
+
 /*
  * Dispatch pcap packets over thread queues
  */
@@ -210,13 +690,30 @@ int packet_dispatch_loop(pcap_t *pcap, void *arg)
     int vlan_tag = 0;
     struct pcap_pkthdr *phdr;
     const u_char *pdata;
-    unsigned int num_workers = *((unsigned int *) arg);
-
-    while (pdi_loop && pcap_next_ex(pcap, &phdr, &pdata) >= 0) {
+    uint64_t governor_check_us = 0;
+    uint64_t packet_us;
+    int ret;
+
+    while (pdi_loop && (ret = pcap_next_ex(pcap, &phdr, &pdata)) >= 0) {
+        if (ret == 0) {
+            /* live capture timeout, no packet */
+            governor_tick();
+            continue;
+        }
+        packet_us = (uint64_t) phdr->ts.tv_sec * 1000000 + phdr->ts.tv_usec;
+        if (packet_us - governor_check_us >= GOVERNOR_CHECK_USEC) {
+            governor_check_us = packet_us;
+            governor_tick();
+        }
         ++packet_number;
         if (packet_number % 10000000 == 1) {
            fprintf(stderr,"packet_number: %lu\n", packet_number);
         }
+        if ((packet_number & (EPOCH_PACKET_INTERVAL - 1)) == 0) {
+            thread_epoch_advance();
+            pdi_device_table_maintain(phdr->ts.tv_sec);
+            thread_snapshot_tick(phdr->ts.tv_sec);
+        }
         packet_get_link_mode(pcap, &link_mode, &remove_llc, &link_mode_loop);
         packet = packet_filter_and_build(phdr, pdata, link_mode, remove_llc, link_mode_loop, &vlan_tag);
         if (packet == NULL) {
@@ -228,25 +725,39 @@ int packet_dispatch_loop(pcap_t *pcap, void *arg)
 
         /* TODO: put device detection before building the packet. */
         int error = 0;
-        struct device_ip *device = packet_check_new_device(packet, link_mode, vlan_tag, &error);
+        int known = 0;
+        int refused = 0;
+        uint32_t hashkey = qmdpi_packet_hashkey_get(pdata, phdr->caplen, link_mode);
+        struct device_ip *device = packet_check_new_device(packet, link_mode, vlan_tag, hashkey,
+                                                           &error, &known, &refused);
 
         /* Filter packet depending on device. If identified, drop it. */
-        int drop = packet_act_on_device(device);
+        int drop = known || refused || packet_act_on_device(device);
         if (drop || error) {
             DBG_PRINTF_3("[dispatch thread] packet %" PRIu64 " Packet dropped: %s\n",
                          packet->packet_number,
-                         error ? "no more device available" :"device not processed any more");
+                         error ? "no more device available" :
+                         known ? "device known" :
+                         refused ? "device creation rate exceeded" : "device not processed any more");
             packet_free(packet);
             continue ;
         }
         packet->device = device;
 
         /* Dispatch packet */
-        uint32_t hashkey = qmdpi_packet_hashkey_get(pdata, phdr->caplen, link_mode);
-        packet_queue(&threads[hashkey % num_workers], packet);
+        int packet_class = packet_classify(packet, packet->link_mode, vlan_tag, hashkey);
+        if (packet_governor_shed(packet_class)) {
+            ++packet_shed;
+            packet_free(packet);
+            continue ;
+        }
+        packet_prio += packet_queue_lane(thread_dispatch_get(hashkey, packet->timestamp.tv_sec),
+                                         packet, hashkey, packet_class != PACKET_CLASS_BULK);
     }
-    printf("Exit packet_dispatch_loop: %lu, packet_filtered: %lu, packet_dropped: %lu\n", 
-       packet_number, packet_filtered, packet_dropped);
+    printf("Exit packet_dispatch_loop: %lu, packet_filtered: %lu, packet_dropped: %lu, packet_prio: %lu, packet_shed: %lu"
+           ", packet_unmonitored: %lu, packet_server_side: %lu\n",
+       packet_number, packet_filtered, packet_dropped, packet_prio, packet_shed, packet_unmonitored,
+       packet_server_side);
 
     return 0;
 }
@@ -318,6 +829,9 @@ packet_filter_and_build(const struct pcap_pkthdr *phdr,
     }
 
     if (packet_filter((uint8_t *) pdata, vlan_tag)) {
+        if (link_mode == QMDPI_PROTO_ETH) {
+            packet_arp_learn(pdata, caplen, &phdr->ts);
+        }
         ++packet_filtered;
         return NULL;
     }
@@ -36,6 +36,61 @@ void print_usage(void)
            "\t--live                        Live capture from interface instead of pcap_files.\n"
            "\t                              By default tries the first interface if none given\n"
            "\t--csv <file>                  Set output CSV file path (default: ./output.csv)\n"
+           "\t--fp_backlog <nb>             Max fingerprints waiting for the device thread\n"
+           "\t                              when its queue is full (default: %d)\n"
+           "\t--dpi_thread <nb>             Number of DPI threads at start-up (default: %d)\n"
+           "\t--dpi_thread_max <nb>         Max DPI threads the load governor may start\n"
+           "\t                              (default: --dpi_thread value)\n"
+           "\t--degrade <level>             Max degradation level under load, 0 disables\n"
+           "\t                              (default: %d with --live, 0 otherwise)\n"
+           "\t                              1: only DHCP, SYN and first payload packets reach DPI\n"
+           "\t                              2: HTTP User-Agent is not extracted\n"
+           "\t                              3: only DHCP and SYN reach DPI\n"
+           "\t--degrade_high <pct>          Load to step down a level (default: %d)\n"
+           "\t--degrade_low <pct>           Load to step back up a level (default: %d)\n"
+           "\t--device_load <pct>           Device table occupancy the table is resized\n"
+           "\t                              around, 25 to 90 (default: %d)\n"
+           "\t--device_idle <sec>           Evict devices unseen for this long, in packet\n"
+           "\t                              time, at least %d (default: %d)\n"
+           "\t--device_max <nb>             Max devices tracked, a device context of the\n"
+           "\t                              library is only used once a device sends\n"
+           "\t                              fingerprints (default: %d per context)\n"
+           "\t--device_prewarm              Allocate all device entries at start-up\n"
+           "\t--device_snapshot <file>      Restore identified devices from file at start-up\n"
+           "\t                              and save them to it periodically and at exit\n"
+           "\t--device_snapshot_interval <sec>\n"
+           "\t                              Seconds of packet time between snapshots\n"
+           "\t                              (default: %d)\n"
+           "\t--inventory <file>            Drop traffic of the known devices listed in file,\n"
+           "\t                              one IPv4 or MAC address per line, optionally\n"
+           "\t                              followed by a comma and metadata\n"
+           "\t--device_filter <a.b.c.d/len>[,...]\n"
+           "\t                              Ranges, /16 to /24, where the dispatcher drops\n"
+           "\t                              traffic of identified devices without a device\n"
+           "\t                              table lookup\n"
+           "\t--dump_select <selector>      Restrict the device dump done on SIGUSR1 to:\n"
+           "\t                              a.b.c.d[/len]: the devices of a subnet\n"
+           "\t                              mac=<address>: the devices of a MAC address\n"
+           "\t                              <metadata>=<value>: identified devices, metadata\n"
+           "\t                              being vendor, model, type, os_vendor, os,\n"
+           "\t                              os_version or nic\n"
+           "\t--monitor <a.b.c.d[/len]>[,...]\n"
+           "\t                              Only create devices for addresses of these\n"
+           "\t                              prefixes (default: all addresses)\n"
+           "\t--exclude <a.b.c.d[/len]>[,...]\n"
+           "\t                              Never create devices for addresses of these\n"
+           "\t                              prefixes, the longest matching --monitor or\n"
+           "\t                              --exclude prefix wins\n"
+           "\t--device_rate <rate>[,<burst>]\n"
+           "\t                              Max devices created per second of packet time,\n"
+           "\t                              packets of refused addresses are dropped\n"
+           "\t                              (default: unlimited, burst: one second)\n"
+           "\t--device_prefix_rate <rate>[,<burst>]\n"
+           "\t                              Max devices created per second and /24\n"
+           "\t                              (default: unlimited, burst: one second)\n",
+           FP_BACKLOG_DEFAULT, NUM_DPI_WORKERS_DEFAULT, GOVERNOR_LEVEL_MAX, GOVERNOR_HIGH_DEFAULT, GOVERNOR_LOW_DEFAULT,
+           DEVICE_LOAD_DEFAULT, DEVICE_IDLE_MIN, DEVICE_IDLE_DEFAULT, DEVICE_ENTRIES_PER_CONTEXT,
+           DEVICE_SNAPSHOT_INTERVAL_DEFAULT
           );
 }
 
@@ -51,10 +106,35 @@ int parse_parameters(int argc, char *argv[], struct opt *opt)
         {"live"      , 0, 0, 'l'},
         {"csv"       , 1, 0, 'c'},
         {"dpi_thread", 1, 0, 'p'},
+        {"dpi_thread_max", 1, 0, 'P'},
+        {"fp_backlog", 1, 0, 'b'},
+        {"degrade"   , 1, 0, 'g'},
+        {"degrade_high", 1, 0, 'H'},
+        {"degrade_low" , 1, 0, 'L'},
+        {"device_load" , 1, 0, 'D'},
+        {"device_idle" , 1, 0, 'I'},
+        {"device_max"  , 1, 0, 'M'},
+        {"device_prewarm", 0, 0, 'W'},
+        {"device_snapshot", 1, 0, 's'},
+        {"device_snapshot_interval", 1, 0, 'S'},
+        {"inventory" , 1, 0, 'K'},
+        {"device_filter", 1, 0, 'F'},
+        {"dump_select", 1, 0, 'd'},
+        {"monitor"   , 1, 0, 'm'},
+        {"exclude"   , 1, 0, 'x'},
+        {"device_rate", 1, 0, 'r'},
+        {"device_prefix_rate", 1, 0, 'R'},
         {0, 0, 0, 0},
     };
 
     memset(opt, 0, sizeof(*opt));
+    opt->fp_backlog = FP_BACKLOG_DEFAULT;
+    opt->degrade = -1;
+    opt->degrade_high = GOVERNOR_HIGH_DEFAULT;
+    opt->degrade_low = GOVERNOR_LOW_DEFAULT;
+    opt->device_load = DEVICE_LOAD_DEFAULT;
+    opt->device_idle = DEVICE_IDLE_DEFAULT;
+    opt->device_snapshot_interval = DEVICE_SNAPSHOT_INTERVAL_DEFAULT;
 
     while ((c = getopt_long(argc, argv, "v", opts, &opti)) != -1) {
         ret = 0;
@@ -83,6 +163,78 @@ int parse_parameters(int argc, char *argv[], struct opt *opt)
                 opt->num_dpi_workers = (unsigned int) atoi(optarg);
                 num_params += 2;
                 break;
+            case 'P':
+                opt->num_dpi_workers_max = (unsigned int) atoi(optarg);
+                num_params += 2;
+                break;
+            case 'b':
+                opt->fp_backlog = (unsigned int) atoi(optarg);
+                num_params += 2;
+                break;
+            case 'g':
+                opt->degrade = atoi(optarg);
+                num_params += 2;
+                break;
+            case 'H':
+                opt->degrade_high = (unsigned int) atoi(optarg);
+                num_params += 2;
+                break;
+            case 'L':
+                opt->degrade_low = (unsigned int) atoi(optarg);
+                num_params += 2;
+                break;
+            case 'D':
+                opt->device_load = (unsigned int) atoi(optarg);
+                num_params += 2;
+                break;
+            case 'I':
+                opt->device_idle = (unsigned int) atoi(optarg);
+                num_params += 2;
+                break;
+            case 'M':
+                opt->device_max = (unsigned int) atoi(optarg);
+                num_params += 2;
+                break;
+            case 'W':
+                opt->device_prewarm = 1;
+                num_params++;
+                break;
+            case 's':
+                opt->device_snapshot = optarg;
+                num_params += 2;
+                break;
+            case 'S':
+                opt->device_snapshot_interval = (unsigned int) atoi(optarg);
+                num_params += 2;
+                break;
+            case 'K':
+                opt->inventory = optarg;
+                num_params += 2;
+                break;
+            case 'F':
+                opt->device_filter = optarg;
+                num_params += 2;
+                break;
+            case 'd':
+                opt->dump_select = optarg;
+                num_params += 2;
+                break;
+            case 'm':
+                opt->monitor = optarg;
+                num_params += 2;
+                break;
+            case 'x':
+                opt->exclude = optarg;
+                num_params += 2;
+                break;
+            case 'r':
+                opt->device_rate = optarg;
+                num_params += 2;
+                break;
+            case 'R':
+                opt->device_prefix_rate = optarg;
+                num_params += 2;
+                break;
             default: /* '?' */
                 /* unknown option */
                 ret = -1;
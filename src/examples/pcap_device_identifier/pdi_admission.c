@@ -0,0 +1,264 @@
+/*
+  This file is a part of Qosmos Device Identification library
+
+  Copyright Qosmos Tech 2000-2018 - All rights reserved
+
+  This computer program and all its components are protected by
+  authors' rights and copyright law and by international treaties.
+  Any representation, reproduction, distribution or modification
+  of this program or any portion of it is forbidden without
+  Qosmos explicit and written agreement and may result in severe
+  civil and criminal penalties, and will be prosecuted
+  to the maximum extent possible under the law.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <arpa/inet.h>
+
+#include "pdi_common.h"
+#include "pdi_utils.h"
+
+/*
+ * Device creation admission.
+ *
+ * A scan or a flood of spoofed sources would otherwise create a device for
+ * each address, evicting real devices when entries run short. Creations
+ * are admitted by token buckets refilled in packet time: one per /24 of
+ * the source address, --device_prefix_rate, and one for all creations,
+ * --device_rate. Packets of devices that already exist are never checked;
+ * those of a refused address are dropped.
+ *
+ * Prefix buckets live in a direct-mapped array: a prefix that takes the
+ * place of another inherits its bucket, so that sources spread over many
+ * prefixes do not get a full burst each time they evict a bucket.
+ *
+ * Such sources may still exhaust the global bucket. So that real devices
+ * get in meanwhile, an address whose binding to a MAC address a DHCP
+ * server acknowledged only goes through the bucket of its prefix, see
+ * pdi_mac.c. Bindings are learnt from ARP and DHCP packets, which may be
+ * forged too: changes of bindings are admitted by their own bucket, at
+ * --device_rate.
+ *
+ * Only the dispatcher thread uses the buckets: they take no lock.
+ */
+
+#define ADMISSION_PREFIX_SHIFT  8       /* /24 */
+#define ADMISSION_PREFIX_SZ     (1u << 12)
+#define ADMISSION_TOKEN         1000000 /* a token in micro tokens */
+
+struct admission_bucket {
+    uint64_t    tokens;     /* micro tokens */
+    uint64_t    last_us;    /* packet time of the last refill, 0 if unused */
+};
+
+struct admission_rate {
+    unsigned int rate;      /* tokens per second, 0: unlimited */
+    unsigned int burst;     /* bucket size, in tokens */
+};
+
+static struct {
+    struct admission_rate   global_rate;
+    struct admission_rate   prefix_rate;
+    struct admission_bucket global;
+    struct admission_bucket learn;      /* binding changes, at global_rate */
+    struct admission_bucket *prefix;    /* ADMISSION_PREFIX_SZ, NULL if unlimited */
+    uint64_t    admitted;
+    uint64_t    admitted_bound;     /* without global token */
+    uint64_t    refused_prefix;
+    uint64_t    refused_global;
+    uint64_t    refused_learn;
+} admission;
+
+/*
+ * Parse <rate>[,<burst>], the burst defaulting to one second of rate.
+ * return 0 on success, -1 on failure.
+ */
+static int admission_rate_parse(const char *str, const char *name, struct admission_rate *rate)
+{
+    char end;
+    int nb;
+
+    memset(rate, 0, sizeof(*rate));
+    if (str == NULL) {
+        return 0;
+    }
+
+    nb = sscanf(str, "%u,%u%c", &rate->rate, &rate->burst, &end);
+    if (nb != 1 && nb != 2) {
+        fprintf(stderr, "ERROR: invalid %s %s, expected <rate>[,<burst>]\n", name, str);
+        return -1;
+    }
+    if (nb == 1 || rate->burst == 0) {
+        rate->burst = rate->rate;
+    }
+
+    return 0;
+}
+
+static void admission_bucket_fill(struct admission_bucket *bucket,
+                                  const struct admission_rate *rate,
+                                  uint64_t now_us)
+{
+    bucket->tokens = (uint64_t) rate->burst * ADMISSION_TOKEN;
+    bucket->last_us = now_us;
+}
+
+/*
+ * Refill a bucket up to now_us and take a token from it.
+ * return 1 if a token was taken, 0 if the bucket is empty.
+ */
+static int admission_bucket_take(struct admission_bucket *bucket,
+                                 const struct admission_rate *rate,
+                                 uint64_t now_us)
+{
+    uint64_t max = (uint64_t) rate->burst * ADMISSION_TOKEN;
+
+    /* Packet time may go backwards across pcap files. */
+    if (now_us > bucket->last_us) {
+        uint64_t elapsed = now_us - bucket->last_us;
+
+        /* A micro token per microsecond and token per second. */
+        if (elapsed >= max / rate->rate || bucket->tokens + elapsed * rate->rate > max) {
+            bucket->tokens = max;
+        } else {
+            bucket->tokens += elapsed * rate->rate;
+        }
+        bucket->last_us = now_us;
+    }
+
+    if (bucket->tokens < ADMISSION_TOKEN) {
+        return 0;
+    }
+    bucket->tokens -= ADMISSION_TOKEN;
+
+    return 1;
+}
+
+/*
+ * Set up the --device_rate and --device_prefix_rate buckets.
+ * return 0 on success, -1 on failure.
+ */
+int admission_init(struct opt *opt)
+{
+    memset(&admission, 0, sizeof(admission));
+
+    if (admission_rate_parse(opt->device_rate, "device rate", &admission.global_rate) < 0 ||
+        admission_rate_parse(opt->device_prefix_rate, "device prefix rate", &admission.prefix_rate) < 0) {
+        return -1;
+    }
+
+    if (admission.prefix_rate.rate) {
+        admission.prefix = calloc(ADMISSION_PREFIX_SZ, sizeof(*admission.prefix));
+        if (admission.prefix == NULL) {
+            fprintf(stderr, "ERROR: can't allocate device admission buckets\n");
+            return -1;
+        }
+    }
+
+    if (admission.global_rate.rate || admission.prefix_rate.rate) {
+        printf("Device admission: %u/s burst %u, per /%u: %u/s burst %u (0: unlimited)\n",
+               admission.global_rate.rate, admission.global_rate.burst, 32 - ADMISSION_PREFIX_SHIFT,
+               admission.prefix_rate.rate, admission.prefix_rate.burst);
+    }
+
+    return 0;
+}
+
+/*
+ * Check if a device may be created for the IPv4 address ip_addr, in
+ * network byte order, at packet time now. bound is set if a DHCP server
+ * acknowledged the binding of the address: only the rate of its prefix
+ * applies.
+ * return 1 if it may, 0 if the creation rate of its prefix or the global
+ * one is exceeded.
+ *
+ * The function MUST be called from the packet dispatcher thread.
+ */
+int admission_check(uint32_t ip_addr, const struct timeval *now, int bound)
+{
+    uint64_t now_us = (uint64_t) now->tv_sec * 1000000 + now->tv_usec;
+    struct admission_bucket *bucket = NULL;
+
+    if (admission.prefix) {
+        uint32_t prefix = ntohl(ip_addr) >> ADMISSION_PREFIX_SHIFT;
+
+        /* A prefix that takes the place of another inherits its bucket. */
+        bucket = &admission.prefix[__murmur_hash64((uint8_t *) &prefix, sizeof(prefix)) &
+                                   (ADMISSION_PREFIX_SZ - 1)];
+        if (bucket->last_us == 0) {
+            admission_bucket_fill(bucket, &admission.prefix_rate, now_us);
+        }
+        if (!admission_bucket_take(bucket, &admission.prefix_rate, now_us)) {
+            admission.refused_prefix++;
+            return 0;
+        }
+    }
+
+    if (bound) {
+        admission.admitted_bound++;
+    } else if (admission.global_rate.rate) {
+        if (admission.global.last_us == 0) {
+            admission_bucket_fill(&admission.global, &admission.global_rate, now_us);
+        }
+        if (!admission_bucket_take(&admission.global, &admission.global_rate, now_us)) {
+            /* Give the prefix token back: nothing was created. */
+            if (bucket) {
+                bucket->tokens += ADMISSION_TOKEN;
+            }
+            admission.refused_global++;
+            return 0;
+        }
+    }
+
+    admission.admitted++;
+
+    return 1;
+}
+
+/*
+ * Check if the binding of an address to a MAC address may be learnt or
+ * changed at packet time now.
+ * return 1 if it may, 0 if the rate of binding changes is exceeded.
+ *
+ * The function MUST be called from the packet dispatcher thread.
+ */
+int admission_learn_check(const struct timeval *now)
+{
+    uint64_t now_us = (uint64_t) now->tv_sec * 1000000 + now->tv_usec;
+
+    if (admission.global_rate.rate == 0) {
+        return 1;
+    }
+
+    if (admission.learn.last_us == 0) {
+        admission_bucket_fill(&admission.learn, &admission.global_rate, now_us);
+    }
+    if (!admission_bucket_take(&admission.learn, &admission.global_rate, now_us)) {
+        admission.refused_learn++;
+        return 0;
+    }
+
+    return 1;
+}
+
+void admission_report(void)
+{
+    if (admission.global_rate.rate == 0 && admission.prefix_rate.rate == 0) {
+        return;
+    }
+
+    printf("Device admission: admitted: %" PRIu64 " (DHCP bound: %" PRIu64 ")"
+           ", refused per prefix: %" PRIu64 ", refused globally: %" PRIu64
+           ", binding changes refused: %" PRIu64 "\n",
+           admission.admitted, admission.admitted_bound, admission.refused_prefix,
+           admission.refused_global, admission.refused_learn);
+}
+
+void admission_exit(void)
+{
+    free(admission.prefix);
+    memset(&admission, 0, sizeof(admission));
+}
@@ -24,6 +24,23 @@
 #define NUM_UNMATCHED_FP_PER_DEV_DEFAULT 1
 #define NUM_RESULTS_DEFAULT              5
 #define NUM_DEVICES_DEFAULT              10000
+#define DEVICE_LOAD_DEFAULT              75
+#define DEVICE_IDLE_DEFAULT              3600
+#define DEVICE_IDLE_MIN                  60
+#define DEVICE_SNAPSHOT_INTERVAL_DEFAULT 300
+#define DEVICE_ENTRIES_PER_CONTEXT       4 /* default --device_max per device context */
+
+#define FP_BACKLOG_DEFAULT               65536
+
+/* Load governor degradation levels */
+#define GOVERNOR_LEVEL_NORMAL         0 /* full processing */
+#define GOVERNOR_LEVEL_NO_BULK_DPI    1 /* only fingerprint-bearing packets reach DPI */
+#define GOVERNOR_LEVEL_NO_USER_AGENT  2 /* HTTP User-Agent is not extracted */
+#define GOVERNOR_LEVEL_SYN_DHCP_ONLY  3 /* only DHCP and TCP SYN reach DPI */
+#define GOVERNOR_LEVEL_MAX            GOVERNOR_LEVEL_SYN_DHCP_ONLY
+
+#define GOVERNOR_HIGH_DEFAULT        80 /* load percentage to step down a level */
+#define GOVERNOR_LOW_DEFAULT         40 /* load percentage to step back up */
 
 #define DEVICE_DEFAULT_SCORE       75
 #define FINGERPRINT_MATCHED_COUNT   5
@@ -53,7 +70,25 @@ struct opt {
     char          **pcaps;
     int             pcap_if_index;
     int             num_pcap;
-    unsigned int    num_dpi_workers;
+    unsigned int    num_dpi_workers;     /* DPI threads active at start-up */
+    unsigned int    num_dpi_workers_max; /* DPI threads the load governor may use */
+    unsigned int    fp_backlog; /* max fingerprints waiting outside the device queue */
+    int             degrade;    /* max governor level, -1: default */
+    unsigned int    degrade_high;
+    unsigned int    degrade_low;
+    unsigned int    device_load; /* device table target occupancy, in percent */
+    unsigned int    device_idle; /* seconds before an unseen device is evicted */
+    unsigned int    device_max;  /* max devices, 0: DEVICE_ENTRIES_PER_CONTEXT per context */
+    int             device_prewarm; /* boolean 1: allocate all device entries at start-up */
+    char           *device_snapshot; /* device table snapshot file, NULL if none */
+    unsigned int    device_snapshot_interval; /* seconds of packet time between snapshots */
+    char           *inventory; /* known device inventory file, NULL if none */
+    char           *device_filter; /* identified device filter ranges, NULL if none */
+    char           *dump_select; /* devices dumped on SIGUSR1, NULL for all */
+    char           *monitor;  /* prefixes devices are created for, NULL for all */
+    char           *exclude;  /* prefixes devices are never created for, NULL if none */
+    char           *device_rate;        /* device creations per second, NULL: unlimited */
+    char           *device_prefix_rate; /* device creations per second and /24 */
     int             live;      /* boolean 1: net interface, 0: pcap files */
     int             v;
 };
@@ -78,9 +113,27 @@ struct pdi_dpi_stats {
     uint64_t processed;
     uint64_t errors;
     uint64_t dropped;
+    uint64_t busy_ns;  /* time spent processing, used by the load governor */
+};
+
+/* Fingerprint handoff from DPI threads to the device thread. */
+struct pdi_fp_backlog_stats {
+    uint64_t queued;   /* groups pushed in the device queue */
+    uint64_t parked;   /* groups parked in a device pending slot */
+    uint64_t merged;   /* fingerprints merged in a device pending slot */
+    uint64_t shed;     /* fingerprints dropped, backlog budget reached */
 };
 
-#define THREAD_PAUSE  ((void *) 0x0001)
+/* Epoch marker: pushed in every DPI ring then forwarded to the device thread
+ * to signal that no thread holds a reference to devices retired before it. */
+#define THREAD_EPOCH  ((void *) 0x0001)
+/* Wakes the device thread up when fingerprints are parked in device pending slots. */
+#define THREAD_OVERFLOW ((void *) 0x0002)
+/* Returned by packet_dequeue() when the DPI thread has been removed from the
+ * active set and drained. */
+#define THREAD_PARK     ((void *) 0x0003)
+/* Asks the device thread to save a device table snapshot. */
+#define THREAD_SNAPSHOT ((void *) 0x0004)
 
 /* Simple FIFO of pointers for inter-thread communication.
  * 1 consummer, multiple producers. */
@@ -99,6 +152,18 @@ struct thread_fifo {
 #define PACKET_INDEX(_value)  ((_value) & PACKET_QUEUEMASK)
 #define PACKET_QUEUESZ        (1 << 13)
 #define PACKET_QUEUEMASK      (PACKET_QUEUESZ - 1)
+
+/* Priority lane for packets carrying fingerprints (DHCP, TCP SYN, first
+ * payload packets). It is always dequeued before the bulk lane. */
+#define PRIO_INDEX(_value)    ((_value) & PRIO_QUEUEMASK)
+#define PRIO_QUEUESZ          (1 << 9)
+#define PRIO_QUEUEMASK        (PRIO_QUEUESZ - 1)
+
+/* Flow buckets used to keep per-flow ordering across lanes. */
+#define FLOW_LANE_INDEX(_hashkey) ((_hashkey) & FLOW_LANE_MASK)
+#define FLOW_LANE_HASHSZ      (1 << 12)
+#define FLOW_LANE_MASK        (FLOW_LANE_HASHSZ - 1)
+
 struct pdi_thread {
     uint8_t              *wdata; /* worker data pointer
                                     that reference current
@@ -110,11 +175,24 @@ struct pdi_thread {
     struct device_ip     *device;
     size_t                read_index;
     size_t                write_index;
+    size_t                prio_read_index;
+    size_t                prio_write_index;
+    uint32_t              bulk_enqueued;  /* bulk lane counters, see packet_queue_lane() */
+    uint32_t              bulk_dequeued;
+    uint32_t              last_dispatch;  /* timestamp of the last packet dispatched */
+    int                   parked;         /* not in the active set and drained */
+    int                   parked_ack;     /* THREAD_PARK has been returned */
+    pthread_cond_t        park_cond;
     uint64_t              pkt_nb;
     uint64_t              last_packet_ts;
+    unsigned int          fp_nb;          /* fingerprints in the group being built */
     pthread_mutex_t       lock;
     struct pdi_dpi_stats  stats;
     struct pdi_pkt       *packets[PACKET_QUEUESZ];
+    struct pdi_pkt       *prio_packets[PRIO_QUEUESZ];
+    /* Value of bulk_enqueued after the last bulk packet of the flows of
+     * each bucket. Only used by the dispatcher thread. */
+    uint32_t              flow_bulk_seq[FLOW_LANE_HASHSZ];
 };
 
 struct pdi_dev_ctx {
@@ -125,22 +203,31 @@ struct pdi_dev_ctx {
 
 
 extern int pdi_loop;
+extern int pdi_governor_level;
 extern uint32_t num_dev_ided;
 extern struct opt pdi_options;
 extern struct pdi_thread *threads;
 extern struct thread_fifo device_queue;
+extern struct pdi_fp_backlog_stats fp_backlog_stats;
 
 void thread_init(struct pdi_thread* th);
 void thread_wait(unsigned int nb_workers);
 void thread_stop(unsigned int nb_workers);
-void thread_synchronise(void);
-void thread_synchronise_device(void);
+void thread_epoch_advance(void);
+void thread_epoch_worker_pass(void);
+void thread_snapshot_tick(time_t now);
 int thread_cpu_setaffinity(int cpu_id);
 
 int thread_packet_loop_function(pcap_t *pcap, void *arg);
 
 struct qmdpi_engine;
-int thread_launch(unsigned int nb_workers, struct qmdpi_engine *engine);
+int thread_launch(unsigned int nb_workers, unsigned int nb_active,
+                  struct qmdpi_engine *engine);
+unsigned int thread_workers_active(void);
+void thread_workers_resize(unsigned int nb_active);
+void thread_workers_drain(void);
+struct pdi_thread *thread_dispatch_get(uint32_t hashkey, uint32_t now);
+uint64_t thread_device_busy_get(void);
 int packet_dispatch_loop(pcap_t *pcap, void *arg);
 void reset_packet_counter(void);
 
@@ -149,7 +236,9 @@ int packet_dispatch_loop_amp(pcap_t *pcap, void *arg);
 void thread_fifo_init(struct thread_fifo *queue);
 void thread_fifo_destroy(struct thread_fifo *queue);
 void thread_fifo_push(struct thread_fifo *queue, void *ptr);
+int thread_fifo_try_push(struct thread_fifo *queue, void *ptr);
 void *thread_fifo_pop(struct thread_fifo *queue);
+size_t thread_fifo_depth(struct thread_fifo *queue);
 void thread_fifo_lock(struct thread_fifo *queue);
 void thread_fifo_unlock(struct thread_fifo *queue);
 
@@ -157,7 +246,7 @@ struct qmdev_fingerprint_group;
 void pdi_dev_thread_process_fingerprint(struct qmdev_fingerprint_group *fp_group);
 void *device_identification_thread_main(void *arg);
 void device_identification_process_fingerprint(struct qmdev_fingerprint_group *fp_group);
-void thread_fingerprint_queue(struct qmdev_fingerprint_group *fp_group);
+int thread_fingerprint_queue(struct pdi_thread *th, struct qmdev_fingerprint_group *fp_group);
 
 void print_usage(void);
 int parse_parameters(int argc, char *argv[], struct opt *opt);
@@ -170,6 +259,8 @@ void dpi_engine_process_result(struct pdi_thread *th,
                                struct qmdpi_result *result);
 
 void packet_queue(struct pdi_thread *thread, struct pdi_pkt *packet);
+int packet_queue_lane(struct pdi_thread *thread, struct pdi_pkt *packet,
+                      uint32_t hashkey, int prio);
 struct pdi_pkt *packet_dequeue(struct pdi_thread *thread);
 void packet_free(struct pdi_pkt *p);
 
@@ -177,4 +268,35 @@ int dpi_process_packet(struct pdi_pkt *pkt, struct pdi_thread *ctx);
 void *dpi_processing_thread_main(void *arg);
 
 void remove_devices(void);
+
+void governor_init(struct opt *opt);
+void governor_tick(void);
+void governor_report(void);
+
+int inventory_load(const char *path);
+int inventory_match(uint32_t ip_addr, const uint8_t *mac);
+void inventory_report(void);
+void inventory_exit(void);
+
+int scope_init(const char *monitor, const char *exclude);
+int scope_match(uint32_t ip_addr);
+void scope_exit(void);
+
+int admission_init(struct opt *opt);
+int admission_check(uint32_t ip_addr, const struct timeval *now, int bound);
+int admission_learn_check(const struct timeval *now);
+void admission_report(void);
+void admission_exit(void);
+
+int lease_init(void);
+void lease_bind(const uint8_t *chaddr, uint32_t ip_addr);
+void lease_report(void);
+void lease_exit(void);
+
+int mac_init(void);
+void mac_learn(uint32_t ip_addr, const uint8_t *mac, int acked, const struct timeval *now);
+void mac_attach(struct device_ip *device, uint32_t ip_addr, const uint8_t *eth_src);
+int mac_acked(uint32_t ip_addr);
+void mac_report(void);
+void mac_exit(void);
 #endif /* __PDI_COMMON_H__ */
@@ -12,12 +12,16 @@
   to the maximum extent possible under the law.
 */
 
+#include <stddef.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
 
 #include <sys/queue.h>
 
@@ -28,218 +32,1770 @@
 #include "pdi_utils.h"
 
 #include "pdi_device.h"
+#include "pdi_device_internal.h"
 
-#define DEVICE_IP_LOOKUP_HASHSZ (1 << 10)
-static SLIST_HEAD (,device_ip) device_ip_hash[DEVICE_IP_LOOKUP_HASHSZ];
+/*
+ * Device table.
+ *
+ * Open addressing hash table, linear probing with Robin Hood displacement:
+ * an entry being inserted takes the slot of any entry closer to its home
+ * slot, which keeps probe sequences short and lets a lookup stop as soon as
+ * it meets an entry closer to home than the searched address would be.
+ *
+ * A slot only holds the IPv4 address and, packed in a second word, the
+ * probe distance and the index of the device entry: 8 slots per cache line.
+ * Device entries are split in two arrays of the same index:
+ * - hot: what the dispatcher reads for every packet, the address, state
+ *   flags and last packet time, 4 entries per cache line,
+ * - cold: the identification details, struct device_ip.
+ * Both arrays are reserved for the maximum number of devices at start-up
+ * and only backed by memory as entries are first used, or at once with
+ * --device_prewarm. Entries never move: packets and fingerprint groups keep
+ * pointers to cold entries, the index of which is their offset. Freed
+ * entries are recycled through a free list. Pending fingerprints, which
+ * several threads write, are protected by a lock of a striped table picked
+ * by entry index rather than by a lock per entry; identification results
+ * by the table lock.
+ *
+ * The slot array doubles when its load goes over --device_load and halves
+ * when it falls under a quarter of it. Resizing is incremental: the
+ * previous array is kept and each insertion or removal moves
+ * DEVICE_REHASH_STEP of its slots to the new one, lookups search both.
+ * pdi_device_table_maintain() completes migrations when the table is idle.
+ *
+ * Lookups take no lock and do no store. Writers are serialised by the table
+ * lock and make seq odd while they modify slots. Only the dispatcher creates
+ * devices, for DHCP requested addresses too, and moves them to the new
+ * address of a DHCP client, so DPI threads never take the lock: the
+ * dispatcher only shares it with the device thread, which records
+ * identification results and reclaims devices. A lookup that saw seq odd
+ * or changed is retried. Slot arrays replaced by a resize may still be read
+ * by a lookup in progress: they are freed like devices, once the epoch that
+ * follows their retirement has completed.
+ *
+ * Devices are evicted once idle for --device_idle seconds of packet time.
+ * Each device sits in the timing wheel bucket of the tick it would expire
+ * at, computed from its last_seen at the time it was linked; a device seen
+ * since is linked again further when its bucket comes up. When device
+ * entries run short, devices of the earliest buckets, the least recently
+ * seen ones, are evicted. Evicted devices go through the same retire and
+ * epoch path as removed ones.
+ *
+ * Table internals shared with the other pdi_device*.c files are in
+ * pdi_device_internal.h: secondary indexes in pdi_device_index.c, the
+ * identified device filter in pdi_device_filter.c, snapshots in
+ * pdi_device_snapshot.c.
+ */
+/* Device entry locks, see device_lock(). */
+#define DEVICE_LOCK_STRIPES     256
+
+/* Old slots moved per insertion or removal, and per maintenance call. */
+#define DEVICE_REHASH_STEP      16
+#define DEVICE_REHASH_IDLE_STEP 1024
+
+/* Devices examined per maintenance call. */
+#define DEVICE_EVICT_STEP       1024
+
+struct device_table device_table = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static struct qmdev_instance *qmdev_instance;
+
+/* One lock per cache line. */
+static struct {
+    pthread_mutex_t     mutex;
+} __attribute__((aligned(64))) device_locks[DEVICE_LOCK_STRIPES];
+
+/* Serialise device context creation and destruction:
+ * qmdev_device_context_destroy() is not thread-safe. It also protects the
+ * context pool. */
+static pthread_mutex_t device_context_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Contexts of freed devices, reset and ready to be attached again: device
+ * churn costs a reset rather than a destruction and a creation. There are
+ * never more contexts than device entries. */
+static struct {
+    struct qmdev_device_context **context;  /* max_entries */
+    uint32_t            nb;
+    uint64_t            nb_reused;
+} device_context_pool;
+
+/* Devices unlinked from the table but possibly still referenced by queued
+ * packets or fingerprint groups, and slot arrays possibly still read by a
+ * lookup.
+ * - *_retired: waiting for the next epoch to start.
+ * - *_reclaimable: waiting for the epoch in flight to complete. */
+static SLIST_HEAD(, device_ip) device_retired = SLIST_HEAD_INITIALIZER(device_retired);
+static SLIST_HEAD(, device_ip) device_reclaimable = SLIST_HEAD_INITIALIZER(device_reclaimable);
+static SLIST_HEAD(, device_slot_array) slots_retired = SLIST_HEAD_INITIALIZER(slots_retired);
+static SLIST_HEAD(, device_slot_array) slots_reclaimable = SLIST_HEAD_INITIALIZER(slots_reclaimable);
+static pthread_mutex_t device_retire_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Devices with a pending fingerprint group, in parking order. */
+static STAILQ_HEAD(, device_ip) device_overflow = STAILQ_HEAD_INITIALIZER(device_overflow);
+static pthread_mutex_t device_overflow_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Number of fingerprints held in device pending slots. */
+static unsigned int device_pending_fp;
+
+/* Fingerprint groups kept as spare, written by the device thread only. */
+static uint64_t device_fpg_reused;
+
+/* OS version strings, index 0 is the empty string. Strings never change
+ * once nb is published: readers need no lock. */
+static struct {
+    uint32_t            nb;
+    uint16_t            hash[DEVICE_OS_VERSION_HASHSZ];     /* 0: empty */
+    char                str[DEVICE_OS_VERSION_MAX][DEVICE_OS_VERSION_SZ];
+} device_os_version = {
+    .nb = 1,
+};
+
+/* Devices the table dump is restricted to, see --dump_select. */
+static struct device_select device_dump_select;
+
+/* Lock of the pending fingerprints of a device, written by several
+ * threads. */
+static inline pthread_mutex_t *device_lock(device_ip_t *device)
+{
+    return &device_locks[device_table_index(&device_table, device) & (DEVICE_LOCK_STRIPES - 1)].mutex;
+}
+
+/* Slots are read concurrently by lookups. */
+static inline void device_slot_set(struct device_slot *slot, uint32_t ip, uint32_t entry)
+{
+    __atomic_store_n(&slot->ip, ip, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->entry, entry, __ATOMIC_RELAXED);
+}
+
+/*
+ * return the slot holding ip, NULL if ip is not in the array.
+ *
+ * Without the table lock, the result is only meaningful if seq did not
+ * change meanwhile; the probe length is bounded so that a lookup racing
+ * with a writer still terminates.
+ */
+static struct device_slot *device_slots_lookup(struct device_slot_array *array,
+                                               uint32_t ip,
+                                               uint32_t hash_key)
+{
+    uint32_t mask = array->mask;
+    uint32_t pos = hash_key & mask;
+    uint32_t dist;
+
+    for (dist = 0; dist <= DEVICE_SLOT_DIST_MAX; dist++) {
+        struct device_slot *slot = &array->slot[pos];
+        uint32_t slot_ip = __atomic_load_n(&slot->ip, __ATOMIC_RELAXED);
+
+        if (slot_ip == ip) {
+            return slot;
+        }
+
+        /* ip would have displaced this entry. */
+        if (slot_ip == 0 ||
+            DEVICE_ENTRY_DIST(__atomic_load_n(&slot->entry, __ATOMIC_RELAXED)) < dist) {
+            return NULL;
+        }
+
+        pos = (pos + 1) & mask;
+    }
+
+    return NULL;
+}
+
+/*
+ * Insert ip, known to be absent, pointing to entry index.
+ * return 0 on success, -1 if a probe distance would overflow.
+ */
+int device_slots_insert(struct device_slots *slots,
+                        uint32_t ip,
+                        uint32_t hash_key,
+                        uint32_t index)
+{
+    struct device_slot_array *array = slots->array;
+    struct device_slot slot = { ip, index };
+    uint32_t pos = hash_key & array->mask;
+    uint32_t dist;
+
+    /* Displaced entries only move up to the first empty slot: none of them
+     * ends up further from home than this slot is from ours. */
+    for (dist = 0; array->slot[(pos + dist) & array->mask].ip; dist++) {
+        if (dist >= DEVICE_SLOT_DIST_MAX) {
+            return -1;
+        }
+    }
+
+    for (dist = 0; ; dist++) {
+        struct device_slot *cur = &array->slot[pos];
+
+        if (cur->ip == 0) {
+            device_slot_set(cur, slot.ip, DEVICE_SLOT_ENTRY(dist, DEVICE_SLOT_INDEX(&slot)));
+            break;
+        }
+
+        if (DEVICE_SLOT_DIST(cur) < dist) {
+            struct device_slot tmp = *cur;
+
+            device_slot_set(cur, slot.ip, DEVICE_SLOT_ENTRY(dist, DEVICE_SLOT_INDEX(&slot)));
+            slot = tmp;
+            dist = DEVICE_SLOT_DIST(&tmp);
+        }
+
+        pos = (pos + 1) & array->mask;
+    }
+
+    slots->nb_entries++;
+
+    return 0;
+}
+
+/*
+ * Remove slot and shift the following entries back towards their home slot.
+ */
+static void device_slots_delete(struct device_slots *slots,
+                                struct device_slot *slot)
+{
+    struct device_slot_array *array = slots->array;
+    uint32_t pos = slot - array->slot;
+
+    for (;;) {
+        uint32_t next = (pos + 1) & array->mask;
+        struct device_slot *cur = &array->slot[next];
+
+        if (cur->ip == 0 || DEVICE_SLOT_DIST(cur) == 0) {
+            break;
+        }
+
+        device_slot_set(&array->slot[pos], cur->ip,
+                        DEVICE_SLOT_ENTRY(DEVICE_SLOT_DIST(cur) - 1, DEVICE_SLOT_INDEX(cur)));
+        pos = next;
+    }
+
+    device_slot_set(&array->slot[pos], 0, 0);
+    slots->nb_entries--;
+}
+
+struct device_slot_array *device_slot_array_alloc(uint32_t nb_slots)
+{
+    struct device_slot_array *array = calloc(1, sizeof(struct device_slot_array) +
+                                                nb_slots * sizeof(struct device_slot));
+
+    if (array) {
+        array->mask = nb_slots - 1;
+    }
+
+    return array;
+}
+
+void device_slot_array_retire(struct device_slot_array *array)
+{
+    pthread_mutex_lock(&device_retire_lock);
+    SLIST_INSERT_HEAD(&slots_retired, array, next);
+    pthread_mutex_unlock(&device_retire_lock);
+}
+
+/*
+ * Lock-free lookup.
+ * return the device of address ip, NULL if ip is not in the table.
+ */
+static device_ip_t *device_table_find(struct device_table *table,
+                                      uint32_t ip,
+                                      uint32_t hash_key)
+{
+    struct device_slot_array *array = NULL;
+    struct device_slot *slot = NULL;
+    uint32_t entry = 0;
+    unsigned int seq;
+
+    for (;;) {
+        seq = __atomic_load_n(&table->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+
+        array = __atomic_load_n(&table->cur.array, __ATOMIC_RELAXED);
+        slot = device_slots_lookup(array, ip, hash_key);
+        if (slot == NULL) {
+            array = __atomic_load_n(&table->old.array, __ATOMIC_RELAXED);
+            if (array) {
+                slot = device_slots_lookup(array, ip, hash_key);
+            }
+        }
+        if (slot) {
+            entry = __atomic_load_n(&slot->entry, __ATOMIC_RELAXED);
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&table->seq, __ATOMIC_RELAXED) == seq) {
+            break;
+        }
+    }
+
+    return slot ? device_table_entry(table, DEVICE_ENTRY_INDEX(entry)) : NULL;
+}
+
+/*
+ * return the slot holding ip and set *slots to its array,
+ * NULL if ip is not in the table.
+ *
+ * The table lock MUST be held.
+ */
+struct device_slot *device_table_lookup(struct device_table *table,
+                                        uint32_t ip,
+                                        uint32_t hash_key,
+                                        struct device_slots **slots)
+{
+    struct device_slot *slot = device_slots_lookup(table->cur.array, ip, hash_key);
+
+    *slots = &table->cur;
+    if (slot == NULL && table->old.array) {
+        slot = device_slots_lookup(table->old.array, ip, hash_key);
+        *slots = &table->old;
+    }
+
+    return slot;
+}
+
+static void device_unlinked(device_ip_t *device);
+
+/*
+ * Move up to nb old slots to the current array.
+ *
+ * The table lock MUST be held, within a write section.
+ */
+static void device_table_rehash(struct device_table *table, unsigned int nb)
+{
+    struct device_slots *old = &table->old;
+
+    while (old->array && nb--) {
+        struct device_slot *slot = NULL;
+        device_ip_t *device = NULL;
+
+        if (old->nb_entries == 0) {
+            device_slot_array_retire(old->array);
+            __atomic_store_n(&old->array, NULL, __ATOMIC_RELAXED);
+            break;
+        }
+
+        /* A backward shift wrapping around the array end may have moved an
+         * entry behind the cursor. */
+        if (table->rehash_index > old->array->mask) {
+            table->rehash_index = 0;
+        }
+
+        /* Backward shift may bring the next entry into this slot:
+         * only move on once it is empty. */
+        slot = &old->array->slot[table->rehash_index];
+        if (slot->ip == 0) {
+            table->rehash_index++;
+            continue;
+        }
+
+        if (device_slots_insert(&table->cur, slot->ip,
+                                get_ip_address_hash_key(slot->ip),
+                                DEVICE_SLOT_INDEX(slot)) < 0) {
+            fprintf(stderr, "ERROR: device table probe sequence too long for " IP4_FMT
+                            ", device dropped\n", IP4_FMT_ARGS(slot->ip));
+            device = device_table_entry(table, DEVICE_SLOT_INDEX(slot));
+            LIST_REMOVE(device, wheel_next);
+            device_unlinked(device);
+            pthread_mutex_lock(&device_retire_lock);
+            SLIST_INSERT_HEAD(&device_retired, device, next);
+            pthread_mutex_unlock(&device_retire_lock);
+        }
+        device_slots_delete(old, slot);
+    }
+}
+
+/*
+ * Start migrating to an array of nb_slots slots.
+ *
+ * The table lock MUST be held, within a write section, and no migration be
+ * in flight.
+ */
+static void device_table_resize(struct device_table *table, uint32_t nb_slots)
+{
+    struct device_slot_array *array = device_slot_array_alloc(nb_slots);
+    uint32_t previous = table->cur.array->mask + 1;
+
+    if (array == NULL) {
+        fprintf(stderr, "ERROR: can't allocate %u device table slots\n", nb_slots);
+        return;
+    }
+
+    if (nb_slots > previous) {
+        table->nb_grow++;
+    } else {
+        table->nb_shrink++;
+    }
+
+    fprintf(stderr, "device table: %s from %u to %u slots, %u devices\n",
+            nb_slots > previous ? "growing" : "shrinking",
+            previous, nb_slots, table->cur.nb_entries);
+
+    table->old.nb_entries = table->cur.nb_entries;
+    __atomic_store_n(&table->old.array, table->cur.array, __ATOMIC_RELAXED);
+    table->cur.nb_entries = 0;
+    __atomic_store_n(&table->cur.array, array, __ATOMIC_RELAXED);
+    table->rehash_index = 0;
+}
+
+/*
+ * Advance a migration in flight, or start one if the load is out of range.
+ *
+ * The table lock MUST be held, within a write section.
+ */
+void device_table_balance(struct device_table *table)
+{
+    uint64_t nb_slots = table->cur.array->mask + 1;
+    uint64_t nb_entries = table->cur.nb_entries;
+
+    if (table->old.array) {
+        device_table_rehash(table, DEVICE_REHASH_STEP);
+        return;
+    }
+
+    if (nb_entries * 100 > nb_slots * table->load) {
+        device_table_resize(table, nb_slots << 1);
+    } else if (nb_slots > DEVICE_SLOTS_MIN && nb_entries * 400 < nb_slots * table->load) {
+        device_table_resize(table, nb_slots >> 1);
+    }
+}
+
+/*
+ * Clear the state and index entries of a device that has just been
+ * unlinked from the slots.
+ *
+ * The table lock MUST be held.
+ */
+static void device_unlinked(device_ip_t *device)
+{
+    struct device_hot *hot = device_hot(device);
+
+    device_index_remove(&device_table, device);
+    __atomic_and_fetch(&hot->state, ~DEVICE_STATE_LINKED, __ATOMIC_SEQ_CST);
+    device_filter_clear(hot->ip);
+}
+
+/*
+ * return the wheel tick the device expires at.
+ */
+static inline uint64_t device_wheel_expiry(struct device_table *table,
+                                           device_ip_t *device)
+{
+    time_t last_seen = __atomic_load_n(&device_hot(device)->last_seen, __ATOMIC_RELAXED);
+
+    if (last_seen == 0) {
+        /* Not touched by the dispatcher yet: being created. */
+        last_seen = table->now;
+    }
+
+    return ((uint64_t) last_seen + table->idle) / table->tick_sec;
+}
+
+/*
+ * The table lock MUST be held.
+ */
+void device_wheel_link(struct device_table *table,
+                       device_ip_t *device)
+{
+    uint64_t tick = device_wheel_expiry(table, device);
+
+    if (tick <= table->wheel_tick) {
+        tick = table->wheel_tick + 1;
+    } else if (tick >= table->wheel_tick + DEVICE_WHEEL_SZ) {
+        tick = table->wheel_tick + DEVICE_WHEEL_SZ - 1;
+    }
+
+    LIST_INSERT_HEAD(&table->wheel[tick % DEVICE_WHEEL_SZ], device, wheel_next);
+}
+
+/*
+ * Unlink a device, already out of the wheel, from the slots and retire it.
+ *
+ * The table lock MUST be held, within a write section.
+ */
+static void device_table_evict(struct device_table *table,
+                               device_ip_t *device)
+{
+    uint32_t ip = device_hot(device)->ip;
+    struct device_slots *slots = NULL;
+    struct device_slot *slot = NULL;
+
+    slot = device_table_lookup(table, ip, get_ip_address_hash_key(ip), &slots);
+    if (slot) {
+        device_slots_delete(slots, slot);
+    }
+    device_unlinked(device);
+
+    pthread_mutex_lock(&device_retire_lock);
+    SLIST_INSERT_HEAD(&device_retired, device, next);
+    pthread_mutex_unlock(&device_retire_lock);
+}
+
+/*
+ * Start the wheel at the current packet time. Devices created before were
+ * linked relatively to time 0: link them again, devices restored from a
+ * snapshot as seen now.
+ *
+ * The table lock MUST be held.
+ */
+static void device_wheel_start(struct device_table *table)
+{
+    struct device_wheel_bucket early = LIST_HEAD_INITIALIZER(early);
+    device_ip_t *device = NULL;
+    unsigned int i;
+
+    for (i = 0; i < DEVICE_WHEEL_SZ; i++) {
+        while ((device = LIST_FIRST(&table->wheel[i])) != NULL) {
+            LIST_REMOVE(device, wheel_next);
+            LIST_INSERT_HEAD(&early, device, wheel_next);
+        }
+    }
+
+    table->wheel_tick = (uint64_t) table->now / table->tick_sec;
+
+    while ((device = LIST_FIRST(&early)) != NULL) {
+        LIST_REMOVE(device, wheel_next);
+        if (__atomic_load_n(&device_hot(device)->last_seen, __ATOMIC_RELAXED) == 0) {
+            __atomic_store_n(&device_hot(device)->last_seen, table->now, __ATOMIC_RELAXED);
+        }
+        device_wheel_link(table, device);
+    }
+}
+
+/*
+ * Expire wheel ticks up to the current packet time, evicting idle devices.
+ * *budget is decremented for each device examined.
+ *
+ * The table lock MUST be held, within a write section.
+ */
+static void device_wheel_advance(struct device_table *table, unsigned int *budget)
+{
+    uint64_t now_tick = (uint64_t) table->now / table->tick_sec;
+    device_ip_t *device = NULL;
+
+    if (table->wheel_tick + DEVICE_WHEEL_LAG < now_tick) {
+        /* Packet time jumped: skipped buckets are expired next turn. */
+        table->wheel_tick = now_tick - DEVICE_WHEEL_LAG;
+    }
+
+    while (table->wheel_tick < now_tick) {
+        struct device_wheel_bucket *bucket = &table->wheel[table->wheel_tick % DEVICE_WHEEL_SZ];
+
+        while ((device = LIST_FIRST(bucket)) != NULL) {
+            if (*budget == 0) {
+                return;
+            }
+            (*budget)--;
+
+            LIST_REMOVE(device, wheel_next);
+            if (device_wheel_expiry(table, device) > table->wheel_tick ||
+                device_filter_seen(table, device)) {
+                /* Seen since it was linked. */
+                device_wheel_link(table, device);
+            } else {
+                device_table_evict(table, device);
+                table->nb_idle++;
+            }
+        }
+
+        table->wheel_tick++;
+    }
+}
+
+/*
+ * Evict up to nb of the least recently seen devices.
+ * *budget is decremented for each device examined.
+ *
+ * The table lock MUST be held, within a write section.
+ */
+static void device_wheel_evict_lru(struct device_table *table,
+                                   unsigned int nb,
+                                   unsigned int *budget)
+{
+    uint64_t tick = table->wheel_tick;
+    device_ip_t *device = NULL;
+
+    while (nb && *budget && tick < table->wheel_tick + DEVICE_WHEEL_SZ) {
+        device = LIST_FIRST(&table->wheel[tick % DEVICE_WHEEL_SZ]);
+        if (device == NULL) {
+            tick++;
+            continue;
+        }
+        (*budget)--;
+
+        LIST_REMOVE(device, wheel_next);
+        if (device_wheel_expiry(table, device) > tick || device_filter_seen(table, device)) {
+            device_wheel_link(table, device);
+        } else {
+            device_table_evict(table, device);
+            table->nb_lru++;
+            nb--;
+        }
+    }
+}
+
+/*
+ * Reserve nb zeroed entries of size bytes, backed by memory as they are
+ * first written, or right away if prewarm is set.
+ * return NULL on failure.
+ */
+void *device_table_map(uint32_t nb, size_t size, int prewarm)
+{
+    void *map = mmap(NULL, (size_t) nb * size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | (prewarm ? MAP_POPULATE : 0),
+                     -1, 0);
+
+    return map == MAP_FAILED ? NULL : map;
+}
+
+static void device_table_unmap(struct device_table *table)
+{
+    if (table->hot) {
+        munmap(table->hot, (size_t) table->max_entries * sizeof(struct device_hot));
+    }
+    if (table->cold) {
+        munmap(table->cold, (size_t) table->max_entries * sizeof(device_ip_t));
+    }
+    if (device_context_pool.context) {
+        munmap(device_context_pool.context,
+               (size_t) table->max_entries * sizeof(*device_context_pool.context));
+    }
+
+    table->hot = NULL;
+    table->cold = NULL;
+    memset(&device_context_pool, 0, sizeof(device_context_pool));
+}
+
+/*
+ * Take a reset device entry for address ip, from the free list or from the
+ * dense arrays.
+ * return NULL if all entries are in use.
+ *
+ * The table lock MUST be held.
+ */
+device_ip_t *device_table_entry_alloc(struct device_table *table, uint32_t ip)
+{
+    device_ip_t *device = SLIST_FIRST(&table->free_entries);
+    struct device_hot *hot = NULL;
+
+    if (device) {
+        SLIST_REMOVE_HEAD(&table->free_entries, next);
+    } else {
+        if (table->next_index >= table->max_entries) {
+            table->nb_exhausted++;
+            return NULL;
+        }
+
+        device = device_table_entry(table, table->next_index++);
+    }
+
+    memset(device, 0, sizeof(*device));
+    hot = device_hot(device);
+    memset(hot, 0, sizeof(*hot));
+    hot->ip = ip;
+    table->nb_used++;
+
+    return device;
+}
+
+/*
+ * The table lock MUST be held.
+ */
+void device_table_entry_release(struct device_table *table,
+                                device_ip_t *device)
+{
+    SLIST_INSERT_HEAD(&table->free_entries, device, next);
+    table->nb_used--;
+}
+
+uint32_t pdi_device_get_ip_addr(device_ip_t *device_ip)
+{
+    /* A device may be moved to another address, see
+     * pdi_device_table_move(). */
+    return device_ip ? __atomic_load_n(&device_hot(device_ip)->ip, __ATOMIC_RELAXED) : 0;
+}
+
+/*
+ * return the device context of a device, attached on the first call: most
+ * devices never send a fingerprint, only those that do use one of the
+ * library contexts. NULL if the device is identified, restored from a
+ * snapshot without context, or if no context is available.
+ */
+struct qmdev_device_context *
+pdi_device_get_device_context(device_ip_t *device_ip)
+{
+    struct qmdev_device_context *device_context;
+    int ret;
+
+    device_context = __atomic_load_n(&device_ip->device_context, __ATOMIC_ACQUIRE);
+    if (device_context || pdi_device_is_identified(device_ip)) {
+        return device_context;
+    }
+
+    /* Several DPI threads may see the first fingerprints of a device. */
+    pthread_mutex_lock(&device_context_lock);
+    device_context = device_ip->device_context;
+    if (device_context == NULL) {
+        if (device_context_pool.nb) {
+            device_context = device_context_pool.context[--device_context_pool.nb];
+            device_context_pool.nb_reused++;
+            ret = QMDEV_SUCCESS;
+        } else {
+            ret = qmdev_device_context_create(qmdev_instance, &device_context);
+        }
+        if (ret == QMDEV_SUCCESS) {
+            ret = qmdev_device_context_user_handle_set(device_context, device_ip);
+            if (ret != QMDEV_SUCCESS) {
+                qmdev_device_context_destroy(device_context);
+            }
+        }
+        if (ret != QMDEV_SUCCESS) {
+            device_context = NULL;
+            /* Only report the first failure of each shortage. */
+            device_table.nb_contexts_failed++;
+            if (!device_table.contexts_short || DBG_GET_LEVEL() >= 1) {
+                device_table.contexts_short = 1;
+                fprintf(stderr, "ERROR: can't attach device context to " IP4_FMT " (%d), %u in use\n",
+                        IP4_FMT_ARGS(device_hot(device_ip)->ip), ret,
+                        __atomic_load_n(&device_table.nb_contexts, __ATOMIC_RELAXED));
+            }
+        } else {
+            device_table.contexts_short = 0;
+            __atomic_add_fetch(&device_table.nb_contexts, 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&device_ip->device_context, device_context, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&device_context_lock);
+
+    return device_context;
+}
+
+/*
+ * Set up the table for up to nb_devices devices. Only devices that sent
+ * fingerprints hold one of the contexts of the device identification
+ * library, there may be several times more devices than contexts.
+ * The slot array starts small and is resized to keep its occupancy around
+ * --device_load percent. Devices unseen for --device_idle seconds are
+ * evicted.
+ *
+ * return 0 on success, -1 on allocation failure.
+ */
+int pdi_device_table_init(struct qmdev_instance *instance,
+                          unsigned int nb_devices,
+                          struct opt *opt)
+{
+    struct device_table *table = &device_table;
+    unsigned int load = opt->device_load;
+    unsigned int idle = opt->device_idle;
+    unsigned int i;
+
+    if (device_select_parse(opt->dump_select, &device_dump_select) < 0 ||
+        device_filter_init(opt->device_filter) < 0) {
+        return -1;
+    }
+
+    if (nb_devices == 0 || nb_devices > DEVICE_MAX_ENTRIES) {
+        nb_devices = DEVICE_MAX_ENTRIES;
+    }
+
+    if (load < DEVICE_LOAD_MIN || load > DEVICE_LOAD_MAX) {
+        fprintf(stderr, "WARNING: device table load %u%% out of [%u%%, %u%%], using %u%%\n",
+                load, DEVICE_LOAD_MIN, DEVICE_LOAD_MAX, DEVICE_LOAD_DEFAULT);
+        load = DEVICE_LOAD_DEFAULT;
+    }
+
+    if (idle < DEVICE_IDLE_MIN) {
+        fprintf(stderr, "WARNING: device idle timeout %us under %us, using %us\n",
+                idle, DEVICE_IDLE_MIN, DEVICE_IDLE_MIN);
+        idle = DEVICE_IDLE_MIN;
+    }
+
+    table->max_entries = nb_devices;
+    table->cur.array = device_slot_array_alloc(DEVICE_SLOTS_MIN);
+    table->hot = device_table_map(nb_devices, sizeof(struct device_hot), opt->device_prewarm);
+    table->cold = device_table_map(nb_devices, sizeof(device_ip_t), opt->device_prewarm);
+    device_context_pool.context = device_table_map(nb_devices, sizeof(*device_context_pool.context), 0);
+    if (table->cur.array == NULL || table->hot == NULL || table->cold == NULL ||
+        device_context_pool.context == NULL || device_index_init(table, opt->device_prewarm) < 0) {
+        fprintf(stderr, "ERROR: can't allocate device table for %u devices\n", nb_devices);
+        device_filter_exit();
+        free(table->cur.array);
+        table->cur.array = NULL;
+        device_table_unmap(table);
+        return -1;
+    }
+
+    for (i = 0; i < DEVICE_LOCK_STRIPES; i++) {
+        pthread_mutex_init(&device_locks[i].mutex, NULL);
+    }
+
+    table->seq = 0;
+    table->cur.nb_entries = 0;
+    memset(&table->old, 0, sizeof(table->old));
+    table->rehash_index = 0;
+    table->load = load;
+    table->next_index = 0;
+    table->nb_used = 0;
+    table->nb_exhausted = 0;
+    table->nb_grow = 0;
+    table->nb_shrink = 0;
+    SLIST_INIT(&table->free_entries);
+
+    table->now = 0;
+    table->idle = idle;
+    table->tick_sec = (idle + DEVICE_WHEEL_SPAN - 1) / DEVICE_WHEEL_SPAN;
+    table->wheel_tick = 0;
+    table->nb_idle = 0;
+    table->nb_lru = 0;
+    for (i = 0; i < DEVICE_WHEEL_SZ; i++) {
+        LIST_INIT(&table->wheel[i]);
+    }
+
+    if (opt->device_prewarm) {
+        printf("Device table: %u entries pre-allocated\n", nb_devices);
+    }
+
+    qmdev_instance = instance;
+
+    return 0;
+}
+
+/*
+ * Complete a resize while the table sees few insertions and removals,
+ * evict idle devices and, when device entries run short, the least
+ * recently seen ones. now is the current packet time.
+ *
+ * The function is called periodically from the packet dispatcher thread.
+ */
+void pdi_device_table_maintain(time_t now)
+{
+    struct device_table *table = &device_table;
+    unsigned int budget = DEVICE_EVICT_STEP;
+    uint32_t high = table->max_entries - table->max_entries / 16;
+    uint32_t low = table->max_entries - table->max_entries / 8;
+    uint32_t nb_entries;
+
+    if (__atomic_load_n(&table->old.array, __ATOMIC_RELAXED) == NULL &&
+        __atomic_load_n(&table->nb_used, __ATOMIC_RELAXED) <= high &&
+        (uint64_t) now / table->tick_sec <= table->wheel_tick) {
+        return;
+    }
+
+    pthread_mutex_lock(&table->lock);
+    device_table_write_begin(table);
+
+    if (now > table->now) {
+        table->now = now;
+    }
+    if (table->wheel_tick == 0) {
+        device_wheel_start(table);
+    }
+
+    device_wheel_advance(table, &budget);
+
+    /* Entries of evicted devices are only freed once the epoch completes:
+     * evict down to the low mark so as not to evict again meanwhile. */
+    nb_entries = device_table_nb_entries(table);
+    if (table->nb_used > high && nb_entries > low) {
+        device_wheel_evict_lru(table, nb_entries - low, &budget);
+    }
+
+    if (table->old.array) {
+        device_table_rehash(table, DEVICE_REHASH_IDLE_STEP);
+    } else {
+        device_table_balance(table);
+    }
+
+    device_table_write_end(table);
+    pthread_mutex_unlock(&table->lock);
+}
+
+/*
+ * Record traffic from the device at packet time now.
+ */
+void pdi_device_touch(device_ip_t *device, time_t now)
+{
+    struct device_hot *hot = device_hot(device);
+
+    /* At most one store per device and second. */
+    if (__atomic_load_n(&hot->last_seen, __ATOMIC_RELAXED) != now) {
+        __atomic_store_n(&hot->last_seen, now, __ATOMIC_RELAXED);
+    }
+}
+
+void pdi_device_table_report(void)
+{
+    struct device_table *table = &device_table;
+
+    printf("Device table: %u devices, %u slots, grown: %" PRIu64 ", shrunk: %" PRIu64
+           ", idle evicted: %" PRIu64 ", LRU evicted: %" PRIu64 ", entries exhausted: %" PRIu64 "\n",
+           device_table_nb_entries(table), table->cur.array ? table->cur.array->mask + 1 : 0,
+           table->nb_grow, table->nb_shrink, table->nb_idle, table->nb_lru, table->nb_exhausted);
+    printf("Device contexts: %u in use, %u pooled, reused: %" PRIu64 ", attachments failed: %" PRIu64
+           ", fingerprint groups reused: %" PRIu64 "\n",
+           __atomic_load_n(&table->nb_contexts, __ATOMIC_RELAXED), device_context_pool.nb,
+           device_context_pool.nb_reused, table->nb_contexts_failed, device_fpg_reused);
+
+    device_filter_report();
+}
+
+void pdi_device_table_destroy(void)
+{
+    struct device_table *table = &device_table;
+    unsigned int i;
+
+    pdi_device_remove_all();
+
+    while (device_context_pool.nb) {
+        qmdev_device_context_destroy(device_context_pool.context[--device_context_pool.nb]);
+    }
+
+    device_index_exit(table);
+    device_table_unmap(table);
+    free(table->cur.array);
+    free(table->old.array);
+    memset(table, 0, offsetof(struct device_table, lock));
+
+    for (i = 0; i < DEVICE_LOCK_STRIPES; i++) {
+        pthread_mutex_destroy(&device_locks[i].mutex);
+    }
+
+    device_filter_exit();
+}
+
+/*
+ * Reset the context of a freed device and keep it for another device.
+ *
+ * The reset is not thread-safe: it is done under the context lock, like
+ * the creations DPI threads may do meanwhile.
+ *
+ * The function MUST be called from the device thread, or once all threads
+ * are stopped.
+ */
+static void device_context_release(struct qmdev_device_context *device_context)
+{
+    int ret;
+
+    pthread_mutex_lock(&device_context_lock);
+    ret = qmdev_device_context_reset(device_context);
+    if (ret == QMDEV_SUCCESS && device_context_pool.nb < device_table.max_entries) {
+        device_context_pool.context[device_context_pool.nb++] = device_context;
+    } else {
+        qmdev_device_context_destroy(device_context);
+    }
+    pthread_mutex_unlock(&device_context_lock);
+}
+
+/*
+ * Release everything the device holds but its table entry.
+ */
+static void pdi_device_destroy(device_ip_t *device)
+{
+    if (device->pending_fpg) {
+        qmdev_fingerprint_group_destroy(device->pending_fpg);
+        __atomic_sub_fetch(&device_pending_fp, device->pending_fp, __ATOMIC_RELAXED);
+    }
+
+    /* Groups belong to the context, destroy them before it is reset. */
+    if (device->spare_fpg) {
+        qmdev_fingerprint_group_destroy(device->spare_fpg);
+    }
+
+    /* Contexts are only attached to devices that sent fingerprints. */
+    if (device->device_context) {
+        device_context_release(device->device_context);
+        __atomic_sub_fetch(&device_table.nb_contexts, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void pdi_device_free(device_ip_t *device)
+{
+    pdi_device_destroy(device);
+
+    pthread_mutex_lock(&device_table.lock);
+    device_table_entry_release(&device_table, device);
+    pthread_mutex_unlock(&device_table.lock);
+}
+
+int pdi_device_is_identified(device_ip_t *device)
+{
+    return __atomic_load_n(&device_hot(device)->state, __ATOMIC_ACQUIRE) & DEVICE_STATE_IDENTIFIED;
+}
 
-/* read-write lock on device_ip linked list */
-static pthread_rwlock_t device_ip_hash_rwlock[DEVICE_IP_LOOKUP_HASHSZ] = { PTHREAD_RWLOCK_INITIALIZER };
+/*
+ * Intern an OS version string, the only metadata without value ID.
+ * return its index, 0 for an empty or unknown version.
+ *
+ * The function MUST be called from the device thread, or before it starts.
+ */
+uint32_t device_os_version_intern(const char *version)
+{
+    size_t len = version ? strnlen(version, DEVICE_OS_VERSION_SZ - 1) : 0;
+    uint32_t pos;
+    uint32_t index;
 
-static struct qmdev_instance *qmdev_instance;
+    if (len == 0) {
+        return 0;
+    }
 
-static inline uint64_t get_ip_address_hash_key(uint32_t ip)
-{
-    uint64_t hash_key = __murmur_hash64((uint8_t*)&(ip), sizeof(uint32_t));
+    pos = (uint32_t) __murmur_hash64((const uint8_t *) version, len) & (DEVICE_OS_VERSION_HASHSZ - 1);
+    while ((index = device_os_version.hash[pos]) != 0) {
+        if (strncmp(device_os_version.str[index], version, len) == 0 &&
+            device_os_version.str[index][len] == '\0') {
+            return index;
+        }
+        pos = (pos + 1) & (DEVICE_OS_VERSION_HASHSZ - 1);
+    }
 
-    return hash_key % DEVICE_IP_LOOKUP_HASHSZ;
-}
+    index = device_os_version.nb;
+    if (index == DEVICE_OS_VERSION_MAX) {
+        return 0;
+    }
 
+    memcpy(device_os_version.str[index], version, len);
+    device_os_version.str[index][len] = '\0';
+    device_os_version.hash[pos] = index;
+    __atomic_store_n(&device_os_version.nb, index + 1, __ATOMIC_RELEASE);
 
-uint32_t pdi_device_get_ip_addr(device_ip_t *device_ip)
-{
-    return device_ip ? device_ip->ip_addr : 0;
+    return index;
 }
 
-struct qmdev_device_context *
-pdi_device_get_device_context(device_ip_t *device_ip)
+/*
+ * return the OS version string of an index returned by
+ * device_os_version_intern().
+ */
+const char *device_os_version_str(uint32_t index)
 {
-    return device_ip->device_context;
+    return device_os_version.str[index];
 }
 
-void pdi_device_table_init(struct qmdev_instance *instance)
+/*
+ * Get the string of a device metadata, "" if unknown.
+ */
+static const char *device_metadata_get(device_ip_t *device,
+                                       enum qmdev_metadata_identifier id,
+                                       unsigned int *len)
 {
-    int i;
-    for (i = 0; i < DEVICE_IP_LOOKUP_HASHSZ; ++i) {
-        SLIST_INIT(&device_ip_hash[i]);
+    const char *value = NULL;
+
+    if (id == QMDEV_OS_VERSION) {
+        value = device_os_version.str[device->metadata_id[id]];
+        *len = strlen(value);
+    } else if (device->metadata_id[id] == 0 ||
+               qmdev_device_metadata_get_byid(id, device->metadata_id[id], &value, len) != QMDEV_SUCCESS ||
+               value == NULL) {
+        value = "";
+        *len = 0;
     }
 
-    qmdev_instance = instance;
+    return value;
 }
 
-void pdi_device_table_destroy(void)
+/*
+ * Build the metadata string of an identified device:
+ * OS vendor:OS name:OS version:vendor:model:type:nic
+ */
+static void device_metadata_to_string(device_ip_t *device,
+                                      char *buf,
+                                      unsigned int size)
 {
-    /* Array of linked list heads is statically allocated.
-     * But devices need to be destroyed. */
-    pdi_device_remove_all();
-}
+    static const enum qmdev_metadata_identifier order[] = {
+        QMDEV_OS_VENDOR, QMDEV_OS, QMDEV_OS_VERSION,
+        QMDEV_VENDOR, QMDEV_MODEL, QMDEV_TYPE, QMDEV_NIC_VENDOR,
+    };
+    unsigned int pos = 0;
+    unsigned int i;
 
-int pdi_device_is_identified(device_ip_t *device)
-{
-    return device->is_identified;
+    buf[0] = '\0';
+    for (i = 0; i < ARRAY_SIZE(order) && pos < size; i++) {
+        unsigned int len = 0;
+        const char *value = device_metadata_get(device, order[i], &len);
+
+        pos += snprintf(buf + pos, size - pos, "%s%.*s", i ? ":" : "", (int) len, value);
+    }
 }
 
+/*
+ * Record the identification result of a device.
+ * metadata_id holds the value IDs of the device metadata, the OS version
+ * has none and is given as a string.
+ */
 void pdi_device_set_identified(device_ip_t *device,
                                unsigned int score,
                                unsigned int flags,
-                               char *buf)
+                               const unsigned int metadata_id[QMDEV_MAX_METADATA_ID],
+                               const char *os_version)
 {
-    pthread_rwlock_wrlock(&device->rwlock);
+    struct device_table *table = &device_table;
+    uint32_t os_version_id = device_os_version_intern(os_version);
+    int linked;
+    unsigned int i;
+
+    /* Results are read and indexed under the table lock. */
+    pthread_mutex_lock(&table->lock);
+
+    /* A result may be refined: index the device under its new values. */
+    linked = __atomic_load_n(&device_hot(device)->state, __ATOMIC_RELAXED) & DEVICE_STATE_LINKED;
+    if (linked) {
+        device_index_metadata_remove(table, device);
+    }
 
-    device->is_identified = 1;
     device->score = score;
     device->flags = flags;
     device->detected_time = time(NULL);
-    strncpy(device->metadata, buf, 128);
-    buf[127] = '\0';
+    for (i = 0; i < QMDEV_MAX_METADATA_ID; i++) {
+        device->metadata_id[i] = metadata_id[i];
+    }
+    device->metadata_id[QMDEV_OS_VERSION] = os_version_id;
+
+    /* Publish the result along with the flag. */
+    __atomic_or_fetch(&device_hot(device)->state, DEVICE_STATE_IDENTIFIED, __ATOMIC_RELEASE);
 
-    pthread_rwlock_unlock(&device->rwlock);
+    if (linked) {
+        device_index_metadata_add(table, device);
+    }
+
+    pthread_mutex_unlock(&table->lock);
+
+    device_filter_set(device);
+}
+
+/*
+ * return the device of address ip, NULL if there is none. Unlike
+ * pdi_device_table_get_entry(), never creates it.
+ */
+device_ip_t *pdi_device_table_find(uint32_t ip)
+{
+    return ip ? device_table_find(&device_table, ip, get_ip_address_hash_key(ip)) : NULL;
 }
 
 /*
  * return 1 when a new device has been created, 0 otherwise
+ *
+ * The function MUST be called from the packet dispatcher thread, or before
+ * packets are dispatched.
  */
 int pdi_device_table_get_entry(uint32_t      ip,
                                device_ip_t **device)
 {
     int ret = 0;
-    uint64_t hash_key = get_ip_address_hash_key(ip);
-    device_ip_t *device_entry = NULL;
+    struct device_table *table = &device_table;
+    uint32_t hash_key = get_ip_address_hash_key(ip);
+    struct device_slots *slots = NULL;
+    struct device_slot *slot = NULL;
+    device_ip_t *new_device = NULL;
 
     if (ip == 0) {
         return 0;
     }
 
-    *device = NULL;
+    *device = device_table_find(table, ip, hash_key);
+    if (*device) {
+        return 0;
+    }
 
-    pthread_rwlock_wrlock(&device_ip_hash_rwlock[hash_key]);
+    pthread_mutex_lock(&table->lock);
 
-    SLIST_FOREACH(device_entry, &device_ip_hash[hash_key], next) {
-        if(device_entry->ip_addr == ip) {
-            *device = device_entry;
-            break;
-        }
+    /* Another thread may have created the device meanwhile. */
+    slot = device_table_lookup(table, ip, hash_key, &slots);
+    if (slot) {
+        *device = device_table_entry(table, DEVICE_SLOT_INDEX(slot));
+        pthread_mutex_unlock(&table->lock);
+        return 0;
+    }
+
+    new_device = device_table_entry_alloc(table, ip);
+    if (new_device == NULL) {
+        fprintf(stderr, "ERROR: can't allocate device entry\n");
+        pthread_mutex_unlock(&table->lock);
+        return 0;
+    }
+
+    /* The device context is attached on the first fingerprint, see
+     * pdi_device_get_device_context(). */
+    device_table_write_begin(table);
+    ret = device_slots_insert(&table->cur, ip, hash_key, device_table_index(table, new_device));
+    if (ret == 0) {
+        __atomic_or_fetch(&device_hot(new_device)->state, DEVICE_STATE_LINKED, __ATOMIC_RELAXED);
+        device_index_add(table, new_device);
+        device_wheel_link(table, new_device);
+        device_table_balance(table);
+    }
+    device_table_write_end(table);
+
+    if (ret < 0) {
+        pdi_device_destroy(new_device);
+        device_table_entry_release(table, new_device);
+        fprintf(stderr, "ERROR: device table probe sequence too long for " IP4_FMT "\n", IP4_FMT_ARGS(ip));
+        pthread_mutex_unlock(&table->lock);
+        return 0;
+    }
+
+    *device = new_device;
+
+    pthread_mutex_unlock(&table->lock);
+
+    return 1;
+}
+
+/*
+ * Reserve room for nb fingerprints in the pending backlog.
+ * return 0 on success, -1 if the budget is exhausted.
+ */
+static int pdi_device_pending_reserve(unsigned int nb)
+{
+    unsigned int pending = __atomic_add_fetch(&device_pending_fp, nb, __ATOMIC_RELAXED);
+
+    if (pending > pdi_options.fp_backlog) {
+        __atomic_sub_fetch(&device_pending_fp, nb, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Park a fingerprint group the device queue had no room for in the pending
+ * slot of its device.
+ *
+ * return 0 if the group has been parked, -1 if the device already has a
+ * pending group or the backlog budget is exhausted. The caller keeps the
+ * group ownership in that case.
+ */
+int pdi_device_fingerprint_park(struct qmdev_fingerprint_group *fp_group,
+                                unsigned int nb_fp)
+{
+    struct qmdev_device_context *device_context = NULL;
+    device_ip_t *device = NULL;
+
+    if (qmdev_fingerprint_group_device_context_get(fp_group, &device_context) != QMDEV_SUCCESS ||
+        qmdev_device_context_user_handle_get(device_context, (void **) &device) != QMDEV_SUCCESS ||
+        device == NULL) {
+        return -1;
+    }
+
+    if (pdi_device_pending_reserve(nb_fp) < 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(device_lock(device));
+    if (device->pending_fpg) {
+        pthread_mutex_unlock(device_lock(device));
+        __atomic_sub_fetch(&device_pending_fp, nb_fp, __ATOMIC_RELAXED);
+        return -1;
+    }
+    device->pending_fp = nb_fp;
+    __atomic_store_n(&device->pending_fpg, fp_group, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(device_lock(device));
+
+    pthread_mutex_lock(&device_overflow_lock);
+    STAILQ_INSERT_TAIL(&device_overflow, device, overflow_next);
+    pthread_mutex_unlock(&device_overflow_lock);
+
+    return 0;
+}
+
+/*
+ * return the spare fingerprint group of a device, reset and ready to be
+ * filled, NULL if it has none.
+ */
+struct qmdev_fingerprint_group *pdi_device_fingerprint_group_get(device_ip_t *device)
+{
+    if (__atomic_load_n(&device->spare_fpg, __ATOMIC_RELAXED) == NULL) {
+        return NULL;
+    }
+
+    return __atomic_exchange_n(&device->spare_fpg, NULL, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Release a processed fingerprint group. A group can only be reused for its
+ * device context: it is reset and kept as the spare group of its device,
+ * unless the device is identified or already has one.
+ * return 0 on success, the qmdev_fingerprint_group_destroy() error
+ * otherwise.
+ *
+ * The function MUST be called from the device thread: devices are freed
+ * there, never while it releases one of their groups.
+ */
+int pdi_device_fingerprint_group_put(device_ip_t *device,
+                                     struct qmdev_fingerprint_group *fp_group)
+{
+    struct qmdev_fingerprint_group *spare = NULL;
+
+    if (device && !pdi_device_is_identified(device) &&
+        __atomic_load_n(&device->spare_fpg, __ATOMIC_RELAXED) == NULL &&
+        qmdev_fingerprint_group_reset(fp_group) == QMDEV_SUCCESS &&
+        __atomic_compare_exchange_n(&device->spare_fpg, &spare, fp_group, 0,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        device_fpg_reused++;
+        return 0;
+    }
+
+    return qmdev_fingerprint_group_destroy(fp_group);
+}
+
+/*
+ * Add a fingerprint to the pending group of a device, if any.
+ *
+ * return 0 if the fingerprint has been merged,
+ *        1 if it has been dropped because the backlog budget is exhausted,
+ *       -1 if the device has no pending group.
+ */
+int pdi_device_fingerprint_merge(device_ip_t *device,
+                                 unsigned int deep_copy,
+                                 unsigned int proto_id,
+                                 unsigned int attr_id,
+                                 unsigned int attr_flags,
+                                 unsigned int attr_value_len,
+                                 const char  *attr_value)
+{
+    int ret = -1;
+
+    /* Fast path: nothing parked for this device. */
+    if (__atomic_load_n(&device->pending_fpg, __ATOMIC_ACQUIRE) == NULL) {
+        return -1;
     }
-    if (!*device) {
-        device_ip_t *new_device = NULL;
 
-        new_device = malloc(sizeof(device_ip_t));
-        if (new_device == NULL) {
-            fprintf(stderr, "ERROR: can't allocate device entry\n");
-            pthread_rwlock_unlock(&device_ip_hash_rwlock[hash_key]);
-            return 0;
+    pthread_mutex_lock(device_lock(device));
+    if (device->pending_fpg) {
+        if (pdi_device_pending_reserve(1) < 0) {
+            ret = 1;
+        } else if (qmdev_fingerprint_set(device->pending_fpg, deep_copy, proto_id, attr_id,
+                                         attr_flags, attr_value_len, attr_value) == QMDEV_SUCCESS) {
+            device->pending_fp++;
+            ret = 0;
+        } else {
+            __atomic_sub_fetch(&device_pending_fp, 1, __ATOMIC_RELAXED);
+            ret = 1;
         }
+    }
+    pthread_mutex_unlock(device_lock(device));
+
+    return ret;
+}
 
-        memset(new_device, 0, sizeof(device_ip_t));
+/*
+ * Take the oldest pending fingerprint group.
+ * return NULL if no group is pending.
+ *
+ * The function MUST be called from the device thread.
+ */
+struct qmdev_fingerprint_group *pdi_device_overflow_pop(void)
+{
+    device_ip_t *device = NULL;
+    struct qmdev_fingerprint_group *fp_group = NULL;
 
-        /* Init lock */
-        ret = pthread_rwlock_init(&new_device->rwlock, NULL);
-        if (ret < 0) {
-            free(new_device);
-            fprintf(stderr, "ERROR: can't initialise lock %d\n", ret);
-            pthread_rwlock_unlock(&device_ip_hash_rwlock[hash_key]);
-            return 0;
+    if (STAILQ_EMPTY(&device_overflow)) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&device_overflow_lock);
+    device = STAILQ_FIRST(&device_overflow);
+    if (device) {
+        STAILQ_REMOVE_HEAD(&device_overflow, overflow_next);
+    }
+    pthread_mutex_unlock(&device_overflow_lock);
+
+    if (device == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(device_lock(device));
+    fp_group = device->pending_fpg;
+    __atomic_sub_fetch(&device_pending_fp, device->pending_fp, __ATOMIC_RELAXED);
+    device->pending_fp = 0;
+    __atomic_store_n(&device->pending_fpg, NULL, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(device_lock(device));
+
+    return fp_group;
+}
+
+/*
+ * return 1 if the MAC address of a device has been learnt, 0 otherwise.
+ */
+int pdi_device_has_mac(device_ip_t *device)
+{
+    return __atomic_load_n(&device_hot(device)->state, __ATOMIC_RELAXED) & DEVICE_STATE_MAC_LEARNT;
+}
+
+/*
+ * Set the MAC address the dispatcher learnt for a device and index the
+ * device by it.
+ * return 1 if the address of the device changed, 0 otherwise.
+ *
+ * The function MUST be called from the packet dispatcher thread: it is the
+ * only writer of device MAC addresses.
+ */
+int pdi_device_set_mac(device_ip_t *device, const uint8_t *mac)
+{
+    struct device_table *table = &device_table;
+    struct device_hot *hot = device_hot(device);
+
+    if (!device_mac_is_set(mac) ||
+        (pdi_device_has_mac(device) && memcmp(device->mac_addr, mac, sizeof(device->mac_addr)) == 0)) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&table->lock);
+
+    /* Move the device to the MAC index bucket of its new address. */
+    if (__atomic_load_n(&hot->state, __ATOMIC_RELAXED) & DEVICE_STATE_LINKED) {
+        device_index_mac_remove(table, device);
+    }
+
+    /* DPI threads copy it under the lock, see pdi_device_fetch_mac(). */
+    pthread_mutex_lock(device_lock(device));
+    memcpy(device->mac_addr, mac, sizeof(device->mac_addr));
+    pthread_mutex_unlock(device_lock(device));
+
+    if (__atomic_load_n(&hot->state, __ATOMIC_RELAXED) & DEVICE_STATE_LINKED) {
+        device_index_mac_add(table, device);
+    }
+    __atomic_or_fetch(&hot->state, DEVICE_STATE_MAC_LEARNT, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&table->lock);
+
+    return 1;
+}
+
+/*
+ * Copy the learnt MAC address of a device to mac, until it has been
+ * submitted as a fingerprint, see pdi_device_mac_sent().
+ * return 1 if the address has been copied, 0 if it is not learnt yet or
+ * has already been submitted.
+ */
+int pdi_device_fetch_mac(device_ip_t *device, uint8_t *mac)
+{
+    struct device_hot *hot = device_hot(device);
+    uint8_t state = __atomic_load_n(&hot->state, __ATOMIC_ACQUIRE);
+
+    if ((state & (DEVICE_STATE_MAC_LEARNT | DEVICE_STATE_MAC_SENT)) != DEVICE_STATE_MAC_LEARNT) {
+        return 0;
+    }
+
+    pthread_mutex_lock(device_lock(device));
+    memcpy(mac, device->mac_addr, sizeof(device->mac_addr));
+    pthread_mutex_unlock(device_lock(device));
+
+    return 1;
+}
+
+/*
+ * Record that the MAC address of a device reached the device thread.
+ * Until then, several DPI threads may submit it: the fingerprint is the
+ * same.
+ */
+void pdi_device_mac_sent(device_ip_t *device)
+{
+    __atomic_or_fetch(&device_hot(device)->state, DEVICE_STATE_MAC_SENT, __ATOMIC_RELAXED);
+}
+
+/*
+ * Unlink the device of address ip from the table.
+ * The device is freed once no thread can reference it anymore.
+ *
+ * return 1 if a device has been retired, 0 otherwise
+ */
+int pdi_device_table_remove(uint32_t ip)
+{
+    struct device_table *table = &device_table;
+    struct device_slots *slots = NULL;
+    struct device_slot *slot = NULL;
+    device_ip_t *device_entry = NULL;
+
+    pthread_mutex_lock(&table->lock);
+
+    slot = device_table_lookup(table, ip, get_ip_address_hash_key(ip), &slots);
+    if (slot) {
+        device_entry = device_table_entry(table, DEVICE_SLOT_INDEX(slot));
+        LIST_REMOVE(device_entry, wheel_next);
+        device_table_write_begin(table);
+        device_slots_delete(slots, slot);
+        device_table_balance(table);
+        device_table_write_end(table);
+        device_unlinked(device_entry);
+    }
+
+    pthread_mutex_unlock(&table->lock);
+
+    if (device_entry == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&device_retire_lock);
+    SLIST_INSERT_HEAD(&device_retired, device_entry, next);
+    pthread_mutex_unlock(&device_retire_lock);
+
+    return 1;
+}
+
+/*
+ * Move the device of address old_ip to address new_ip, with its
+ * identification, device context and fingerprints in flight: a DHCP client
+ * that changed address keeps its device. A device of new_ip, left by a
+ * previous holder of the address, is retired.
+ *
+ * return 1 if a device has been moved, 0 otherwise
+ *
+ * The function MUST be called from the packet dispatcher thread.
+ */
+int pdi_device_table_move(uint32_t old_ip, uint32_t new_ip)
+{
+    struct device_table *table = &device_table;
+    uint32_t old_hash_key = get_ip_address_hash_key(old_ip);
+    uint32_t new_hash_key = get_ip_address_hash_key(new_ip);
+    struct device_slots *slots = NULL;
+    struct device_slot *slot = NULL;
+    device_ip_t *device = NULL;
+    device_ip_t *stale = NULL;
+    struct device_hot *hot = NULL;
+    uint32_t index;
+    int ret;
+
+    if (old_ip == 0 || new_ip == 0 || old_ip == new_ip) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&table->lock);
+
+    if (device_table_lookup(table, old_ip, old_hash_key, &slots) == NULL) {
+        pthread_mutex_unlock(&table->lock);
+        return 0;
+    }
+
+    device_table_write_begin(table);
+
+    slot = device_table_lookup(table, new_ip, new_hash_key, &slots);
+    if (slot) {
+        stale = device_table_entry(table, DEVICE_SLOT_INDEX(slot));
+        LIST_REMOVE(stale, wheel_next);
+        device_slots_delete(slots, slot);
+        device_unlinked(stale);
+    }
+
+    /* Deleting the stale slot may have shifted the one of old_ip. */
+    slot = device_table_lookup(table, old_ip, old_hash_key, &slots);
+    index = DEVICE_SLOT_INDEX(slot);
+    device = device_table_entry(table, index);
+    hot = device_hot(device);
+    device_slots_delete(slots, slot);
+
+    /* Only the subnet index is keyed by the address. */
+    device_subnet_remove(table, index);
+    __atomic_store_n(&hot->ip, new_ip, __ATOMIC_SEQ_CST);
+    device_filter_clear(old_ip);
+
+    ret = device_slots_insert(&table->cur, new_ip, new_hash_key, index);
+    if (ret == 0) {
+        device_subnet_insert(table, index);
+        if (__atomic_load_n(&hot->state, __ATOMIC_SEQ_CST) & DEVICE_STATE_IDENTIFIED) {
+            device_filter_mark(new_ip);
         }
+    } else {
+        LIST_REMOVE(device, wheel_next);
+        device_unlinked(device);
+    }
+    device_table_balance(table);
+
+    device_table_write_end(table);
+    pthread_mutex_unlock(&table->lock);
+
+    if (ret < 0) {
+        fprintf(stderr, "ERROR: device table probe sequence too long for " IP4_FMT "\n", IP4_FMT_ARGS(new_ip));
+    }
 
-        /* Create device context */
-        ret = qmdev_device_context_create(qmdev_instance, &new_device->device_context);
+    if (stale || ret < 0) {
+        pthread_mutex_lock(&device_retire_lock);
+        if (stale) {
+            SLIST_INSERT_HEAD(&device_retired, stale, next);
+        }
         if (ret < 0) {
-            pthread_rwlock_destroy(&new_device->rwlock);
-            free(new_device);
-            fprintf(stderr, "ERROR: can't allocate device context %d\n", ret);
-            pthread_rwlock_unlock(&device_ip_hash_rwlock[hash_key]);
-            return 0;
+            SLIST_INSERT_HEAD(&device_retired, device, next);
         }
+        pthread_mutex_unlock(&device_retire_lock);
+    }
 
-        new_device->ip_addr = ip;
-        ret = qmdev_device_context_user_handle_set(new_device->device_context, new_device);
-        if (ret < 0) {
-            qmdev_device_context_destroy(new_device->device_context);
-            pthread_rwlock_destroy(&new_device->rwlock);
-            free(new_device);
-            fprintf(stderr, "ERROR: can't set user_handle %d\n", ret);
-            pthread_rwlock_unlock(&device_ip_hash_rwlock[hash_key]);
-            return 0;
+    return ret == 0;
+}
+
+static void device_slots_retire_all(struct device_table *table,
+                                   struct device_slots *slots)
+{
+    device_ip_t *device = NULL;
+    uint32_t i;
+
+    for (i = 0; slots->nb_entries && i <= slots->array->mask; ++i) {
+        struct device_slot *slot = &slots->array->slot[i];
+
+        if (slot->ip == 0) {
+            continue;
         }
 
-        SLIST_INSERT_HEAD(&device_ip_hash[hash_key], new_device, next);
-        *device = new_device;
-        ret = 1;
+        device = device_table_entry(table, DEVICE_SLOT_INDEX(slot));
+        SLIST_INSERT_HEAD(&device_retired, device, next);
+        device_unlinked(device);
+        device_slot_set(slot, 0, 0);
+        slots->nb_entries--;
     }
+}
+
+/*
+ * Unlink all devices from the table.
+ * Devices are freed once no thread can reference them anymore.
+ */
+void pdi_device_retire_all(void)
+{
+    struct device_table *table = &device_table;
+    unsigned int i;
 
-    pthread_rwlock_unlock(&device_ip_hash_rwlock[hash_key]);
+    pthread_mutex_lock(&table->lock);
+    device_table_write_begin(table);
+    pthread_mutex_lock(&device_retire_lock);
 
-    return ret;
+    device_slots_retire_all(table, &table->cur);
+    if (table->old.array) {
+        device_slots_retire_all(table, &table->old);
+        SLIST_INSERT_HEAD(&slots_retired, table->old.array, next);
+        __atomic_store_n(&table->old.array, NULL, __ATOMIC_RELAXED);
+    }
+
+    for (i = 0; i < DEVICE_WHEEL_SZ; i++) {
+        LIST_INIT(&table->wheel[i]);
+    }
+
+    pthread_mutex_unlock(&device_retire_lock);
+    device_table_write_end(table);
+    pthread_mutex_unlock(&table->lock);
 }
 
-int pdi_device_fetch_and_set_mac_flag(device_ip_t *device)
+/*
+ * Move retired devices and slot arrays to the reclaimable lists.
+ *
+ * return 1 if a new epoch must be started for them, 0 if there is nothing to
+ * reclaim or if an epoch is already in flight.
+ */
+int pdi_device_epoch_begin(void)
 {
     int ret = 0;
 
-    if (device == NULL)
-        return 0;
+    pthread_mutex_lock(&device_retire_lock);
+
+    if (SLIST_EMPTY(&device_reclaimable) && SLIST_EMPTY(&slots_reclaimable) &&
+        (!SLIST_EMPTY(&device_retired) || !SLIST_EMPTY(&slots_retired))) {
+        SLIST_FIRST(&device_reclaimable) = SLIST_FIRST(&device_retired);
+        SLIST_INIT(&device_retired);
+        SLIST_FIRST(&slots_reclaimable) = SLIST_FIRST(&slots_retired);
+        SLIST_INIT(&slots_retired);
+        ret = 1;
+    }
 
-    pthread_rwlock_wrlock(&device->rwlock);
-    ret = device->mac_sent;
-    if (!ret)
-        device->mac_sent = 1;
-    pthread_rwlock_unlock(&device->rwlock);
+    pthread_mutex_unlock(&device_retire_lock);
 
     return ret;
 }
 
+/*
+ * Free devices and slot arrays retired before the epoch that has just
+ * completed.
+ *
+ * The function MUST be called from the device thread.
+ */
+void pdi_device_reclaim(void)
+{
+    device_ip_t *device = NULL;
+    struct device_slot_array *array = NULL;
+    SLIST_HEAD(, device_ip) reclaim = SLIST_HEAD_INITIALIZER(reclaim);
+    SLIST_HEAD(, device_slot_array) reclaim_slots = SLIST_HEAD_INITIALIZER(reclaim_slots);
+
+    pthread_mutex_lock(&device_retire_lock);
+    SLIST_FIRST(&reclaim) = SLIST_FIRST(&device_reclaimable);
+    SLIST_INIT(&device_reclaimable);
+    SLIST_FIRST(&reclaim_slots) = SLIST_FIRST(&slots_reclaimable);
+    SLIST_INIT(&slots_reclaimable);
+    pthread_mutex_unlock(&device_retire_lock);
+
+    while ((device = SLIST_FIRST(&reclaim)) != NULL) {
+        SLIST_REMOVE_HEAD(&reclaim, next);
+        pdi_device_free(device);
+    }
+
+    while ((array = SLIST_FIRST(&reclaim_slots)) != NULL) {
+        SLIST_REMOVE_HEAD(&reclaim_slots, next);
+        free(array);
+    }
+}
+
+/*
+ * Free all devices, retired ones included.
+ *
+ * The function MUST be called once all threads are stopped.
+ */
 void pdi_device_remove_all(void)
 {
-    int i;
     device_ip_t *device = NULL;
+    struct device_slot_array *array = NULL;
+
+    pdi_device_retire_all();
 
-    for (i = 0; i < DEVICE_IP_LOOKUP_HASHSZ; ++i) {
-        device = SLIST_FIRST(&device_ip_hash[i]);
-        if (device) {
-            pthread_rwlock_wrlock(&device_ip_hash_rwlock[i]);
+    while ((device = SLIST_FIRST(&device_retired)) != NULL) {
+        SLIST_REMOVE_HEAD(&device_retired, next);
+        pdi_device_free(device);
+    }
 
-            /* Go through the linked list of device. */
-            while (device) {
-                device_ip_t *device_next = SLIST_NEXT(device, next);
+    while ((device = SLIST_FIRST(&device_reclaimable)) != NULL) {
+        SLIST_REMOVE_HEAD(&device_reclaimable, next);
+        pdi_device_free(device);
+    }
 
-                /* remove device */
-                SLIST_REMOVE(&device_ip_hash[i], device, device_ip, next);
+    while ((array = SLIST_FIRST(&slots_retired)) != NULL) {
+        SLIST_REMOVE_HEAD(&slots_retired, next);
+        free(array);
+    }
 
-                /* Free allocations. */
-                qmdev_device_context_destroy(device->device_context);
-                pthread_rwlock_destroy(&device->rwlock);
-                free(device);
+    while ((array = SLIST_FIRST(&slots_reclaimable)) != NULL) {
+        SLIST_REMOVE_HEAD(&slots_reclaimable, next);
+        free(array);
+    }
 
-                device = device_next;
-            }
+    STAILQ_INIT(&device_overflow);
+}
 
-            pthread_rwlock_unlock(&device_ip_hash_rwlock[i]);
-        }
+static void device_dump_one(device_ip_t *device, void *arg)
+{
+    FILE *out = arg;
+    uint32_t ip = device_hot(device)->ip;
+    char str[20];
+    char t[26] = { 0 };
+    char metadata[256] = { 0 };
+
+    snprintf(str, 20, IP4_FMT, IP4_FMT_ARGS(ip));
+    if (pdi_device_is_identified(device)) {
+        struct tm *tm;
+        tm = localtime(&device->detected_time);
+        strftime(t, 26, " %Y:%m:%d %H:%M:%S", tm);
+        device_metadata_to_string(device, metadata, sizeof(metadata));
     }
+
+    fprintf(out, "%-16s %3u   %s%s\n", str, device->score, metadata, t);
 }
 
+/*
+ * Dump the devices of --dump_select, all by default, in address order.
+ */
 void pdi_device_dump_table(FILE *out)
 {
-    int i;
-    device_ip_t *device = NULL;
+    struct device_table *table = &device_table;
 
     fprintf(out, "%-16s Score OS vendor:OS name:OS version:vendor:model:type:nic\n", "IP address");
 
-    for (i = 0; i < DEVICE_IP_LOOKUP_HASHSZ; ++i) {
-        int j = 0;
-        SLIST_FOREACH(device, &device_ip_hash[i], next) {
-            char str[20];
-            char t[20] = { 0 };
-
-            j++;
-            snprintf(str, 20, IP4_FMT, IP4_FMT_ARGS(device->ip_addr));
-            if (device->is_identified) {
-                struct tm *tm;
-                tm = localtime(&device->detected_time);
-                strftime(t, 26, " %Y:%m:%d %H:%M:%S", tm);
-            }
+    pthread_mutex_lock(&table->lock);
+    device_select_scan(table, &device_dump_select, device_dump_one, out);
+    pthread_mutex_unlock(&table->lock);
 
-            fprintf(out, "%-16s %3u   %s%s\n", str, device->score, device->metadata, t);
-        }
-    }
     fflush(out);
 }
@@ -17,13 +17,19 @@
 
 struct qmdev_instance;
 struct device_ip;
+struct opt;
 
 typedef struct device_ip device_ip_t;
 
-void pdi_device_table_init(struct qmdev_instance *instance);
+int pdi_device_table_init(struct qmdev_instance *instance,
+                          unsigned int nb_devices,
+                          struct opt *opt);
+void pdi_device_table_maintain(time_t now);
+void pdi_device_table_report(void);
 void pdi_device_table_destroy(void);
 
 int pdi_device_table_get_entry(uint32_t ip, device_ip_t **current_device_ip_entry);
+device_ip_t *pdi_device_table_find(uint32_t ip);
 void pdi_device_table_destroy(void);
 int pdi_device_is_identified(device_ip_t *device);
 
@@ -34,9 +40,38 @@ int pdi_device_is_identified(device_ip_t *device);
 void pdi_device_set_identified(device_ip_t *device,
                                unsigned int score,
                                unsigned int flags,
-                               char *buf);
+                               const unsigned int metadata_id[QMDEV_MAX_METADATA_ID],
+                               const char *os_version);
 
-int pdi_device_fetch_and_set_mac_flag(device_ip_t *device);
+int pdi_device_has_mac(device_ip_t *device);
+int pdi_device_set_mac(device_ip_t *device, const uint8_t *mac);
+int pdi_device_fetch_mac(device_ip_t *device, uint8_t *mac);
+void pdi_device_mac_sent(device_ip_t *device);
+int pdi_device_filter_match(uint32_t ip);
+void pdi_device_touch(device_ip_t *device, time_t now);
+
+struct qmdev_fingerprint_group;
+int pdi_device_fingerprint_park(struct qmdev_fingerprint_group *fp_group,
+                                unsigned int nb_fp);
+int pdi_device_fingerprint_merge(device_ip_t *device,
+                                 unsigned int deep_copy,
+                                 unsigned int proto_id,
+                                 unsigned int attr_id,
+                                 unsigned int attr_flags,
+                                 unsigned int attr_value_len,
+                                 const char  *attr_value);
+struct qmdev_fingerprint_group *pdi_device_overflow_pop(void);
+struct qmdev_fingerprint_group *pdi_device_fingerprint_group_get(device_ip_t *device);
+int pdi_device_fingerprint_group_put(device_ip_t *device,
+                                     struct qmdev_fingerprint_group *fp_group);
+
+int pdi_device_table_remove(uint32_t ip);
+int pdi_device_table_move(uint32_t old_ip, uint32_t new_ip);
+void pdi_device_retire_all(void);
+int pdi_device_epoch_begin(void);
+void pdi_device_reclaim(void);
 void pdi_device_remove_all(void);
 void pdi_device_dump_table(FILE *out);
+int pdi_device_table_save(const char *path);
+int pdi_device_table_load(const char *path);
 #endif /* _PDI_DEVICE_TABLE_H_ */
@@ -0,0 +1,265 @@
+/*
+  This file is a part of Qosmos Device Identification library
+
+  Copyright Qosmos Tech 2000-2018 - All rights reserved
+
+  This computer program and all its components are protected by
+  authors' rights and copyright law and by international treaties.
+  Any representation, reproduction, distribution or modification
+  of this program or any portion of it is forbidden without
+  Qosmos explicit and written agreement and may result in severe
+  civil and criminal penalties, and will be prosecuted
+  to the maximum extent possible under the law.
+*/
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include <sys/queue.h>
+
+#include "qmdpi.h"
+#include "qmdevice.h"
+
+#include "pdi_common.h"
+#include "pdi_utils.h"
+
+#include "pdi_device.h"
+#include "pdi_device_internal.h"
+
+/*
+ * Identified device filter.
+ *
+ * One bit per address of the --device_filter ranges, set while the device
+ * of the address is identified and in the table. The dispatcher tests it
+ * before any table access. A bit is set by the device thread once the
+ * device is identified and cleared when the device is unlinked. A bit
+ * that is not set only means a table lookup is needed, so a bit may be
+ * cleared too eagerly but never left set.
+ *
+ * Hits skip pdi_device_touch(): they set a second, seen bit instead, that
+ * the wheel consumes before evicting the device as idle.
+ */
+
+/* Ranges, from /16 to /24. */
+#define DEVICE_FILTER_MAX       8
+#define DEVICE_FILTER_LEN_MIN   16
+#define DEVICE_FILTER_LEN_MAX   24
+
+struct device_filter_range {
+    uint32_t prefix;    /* host byte order */
+    uint32_t mask;
+    uint32_t offset;    /* bit of the first address of the range */
+};
+
+static struct {
+    unsigned int        nb;             /* 0: no filter */
+    struct device_filter_range range[DEVICE_FILTER_MAX];
+    uint64_t           *bits;
+    uint64_t           *seen;           /* hits since the wheel last came by */
+    uint64_t            nb_hits;
+} device_filter;
+
+static inline int64_t device_filter_bit(uint32_t ip)
+{
+    uint32_t host_ip = ntohl(ip);
+    unsigned int i;
+
+    for (i = 0; i < device_filter.nb; i++) {
+        struct device_filter_range *range = &device_filter.range[i];
+
+        if ((host_ip & range->mask) == range->prefix) {
+            return range->offset + (host_ip & ~range->mask);
+        }
+    }
+
+    return -1;
+}
+
+void device_filter_clear(uint32_t ip)
+{
+    int64_t bit = device_filter_bit(ip);
+
+    if (bit >= 0) {
+        __atomic_and_fetch(&device_filter.bits[bit >> 6], ~(1ull << (bit & 63)), __ATOMIC_SEQ_CST);
+        __atomic_and_fetch(&device_filter.seen[bit >> 6], ~(1ull << (bit & 63)), __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * return 1 if the address has a bit and it has been set, 0 otherwise.
+ */
+int device_filter_mark(uint32_t ip)
+{
+    int64_t bit = device_filter_bit(ip);
+
+    if (bit < 0) {
+        return 0;
+    }
+
+    __atomic_or_fetch(&device_filter.bits[bit >> 6], 1ull << (bit & 63), __ATOMIC_SEQ_CST);
+
+    return 1;
+}
+
+/*
+ * Record the filter hits of a device since the last call as traffic at the
+ * current packet time.
+ * return 1 if it had hits, 0 otherwise.
+ *
+ * The table lock MUST be held.
+ */
+int device_filter_seen(struct device_table *table, device_ip_t *device)
+{
+    int64_t bit = device_filter_bit(device_hot(device)->ip);
+    uint64_t mask;
+
+    if (bit < 0) {
+        return 0;
+    }
+
+    mask = 1ull << (bit & 63);
+    if (!(__atomic_fetch_and(&device_filter.seen[bit >> 6], ~mask, __ATOMIC_RELAXED) & mask)) {
+        return 0;
+    }
+
+    __atomic_store_n(&device_hot(device)->last_seen, table->now, __ATOMIC_RELAXED);
+
+    return 1;
+}
+
+/*
+ * Set the bit of a device that has just been identified.
+ */
+void device_filter_set(device_ip_t *device)
+{
+    struct device_hot *hot = device_hot(device);
+    uint32_t ip = __atomic_load_n(&hot->ip, __ATOMIC_SEQ_CST);
+
+    /* The device may have been unlinked or moved meanwhile, its bit cleared
+     * before it was set. */
+    if (device_filter_mark(ip) &&
+        (!(__atomic_load_n(&hot->state, __ATOMIC_SEQ_CST) & DEVICE_STATE_LINKED) ||
+         __atomic_load_n(&hot->ip, __ATOMIC_SEQ_CST) != ip)) {
+        device_filter_clear(ip);
+    }
+}
+
+/*
+ * Parse the comma separated --device_filter ranges.
+ * return 0 on success, -1 on failure.
+ */
+int device_filter_init(const char *ranges)
+{
+    char *str = NULL;
+    char *token = NULL;
+    char *saveptr = NULL;
+    uint64_t nb_bits = 0;
+
+    memset(&device_filter, 0, sizeof(device_filter));
+    if (ranges == NULL) {
+        return 0;
+    }
+
+    str = strdup(ranges);
+    if (str == NULL) {
+        fprintf(stderr, "ERROR: can't allocate device filter\n");
+        return -1;
+    }
+
+    for (token = strtok_r(str, ",", &saveptr); token; token = strtok_r(NULL, ",", &saveptr)) {
+        struct device_filter_range *range = &device_filter.range[device_filter.nb];
+        char *len_str = strchr(token, '/');
+        struct in_addr addr;
+        unsigned int len;
+
+        if (len_str) {
+            *len_str++ = '\0';
+        }
+        if (len_str == NULL || inet_pton(AF_INET, token, &addr) != 1 ||
+            sscanf(len_str, "%u", &len) != 1 ||
+            len < DEVICE_FILTER_LEN_MIN || len > DEVICE_FILTER_LEN_MAX) {
+            fprintf(stderr, "ERROR: invalid device filter range %s%s%s, expected a.b.c.d/%u to /%u\n",
+                    token, len_str ? "/" : "", len_str ? len_str : "",
+                    DEVICE_FILTER_LEN_MIN, DEVICE_FILTER_LEN_MAX);
+            free(str);
+            return -1;
+        }
+
+        if (device_filter.nb == DEVICE_FILTER_MAX) {
+            fprintf(stderr, "ERROR: more than %u device filter ranges\n", DEVICE_FILTER_MAX);
+            free(str);
+            return -1;
+        }
+
+        range->mask = ~0u << (32 - len);
+        range->prefix = ntohl(addr.s_addr) & range->mask;
+        range->offset = nb_bits;
+        nb_bits += 1ull << (32 - len);
+        device_filter.nb++;
+    }
+
+    free(str);
+
+    device_filter.bits = calloc((nb_bits + 63) / 64, sizeof(*device_filter.bits));
+    device_filter.seen = calloc((nb_bits + 63) / 64, sizeof(*device_filter.seen));
+    if (device_filter.bits == NULL || device_filter.seen == NULL) {
+        fprintf(stderr, "ERROR: can't allocate device filter\n");
+        free(device_filter.bits);
+        free(device_filter.seen);
+        device_filter.bits = device_filter.seen = NULL;
+        device_filter.nb = 0;
+        return -1;
+    }
+
+    printf("Device filter: %u ranges, %" PRIu64 " addresses\n", device_filter.nb, nb_bits);
+
+    return 0;
+}
+
+/*
+ * return 1 if the device of address ip is known to be identified,
+ * 0 if the table must be looked up.
+ *
+ * The function MUST be called from the packet dispatcher thread.
+ */
+int pdi_device_filter_match(uint32_t ip)
+{
+    int64_t bit;
+
+    if (device_filter.nb == 0) {
+        return 0;
+    }
+
+    bit = device_filter_bit(ip);
+    if (bit < 0 ||
+        !(__atomic_load_n(&device_filter.bits[bit >> 6], __ATOMIC_RELAXED) & (1ull << (bit & 63)))) {
+        return 0;
+    }
+
+    device_filter.nb_hits++;
+    /* At most one store per device and wheel turn. */
+    if (!(__atomic_load_n(&device_filter.seen[bit >> 6], __ATOMIC_RELAXED) & (1ull << (bit & 63)))) {
+        __atomic_or_fetch(&device_filter.seen[bit >> 6], 1ull << (bit & 63), __ATOMIC_RELAXED);
+    }
+
+    return 1;
+}
+
+void device_filter_exit(void)
+{
+    free(device_filter.bits);
+    free(device_filter.seen);
+    memset(&device_filter, 0, sizeof(device_filter));
+}
+
+void device_filter_report(void)
+{
+    if (device_filter.nb) {
+        printf("Device filter: hits: %" PRIu64 "\n", device_filter.nb_hits);
+    }
+}
@@ -0,0 +1,672 @@
+/*
+  This file is a part of Qosmos Device Identification library
+
+  Copyright Qosmos Tech 2000-2018 - All rights reserved
+
+  This computer program and all its components are protected by
+  authors' rights and copyright law and by international treaties.
+  Any representation, reproduction, distribution or modification
+  of this program or any portion of it is forbidden without
+  Qosmos explicit and written agreement and may result in severe
+  civil and criminal penalties, and will be prosecuted
+  to the maximum extent possible under the law.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+
+#include <sys/queue.h>
+
+#include "qmdpi.h"
+#include "qmdevice.h"
+
+#include "pdi_common.h"
+#include "pdi_utils.h"
+
+#include "pdi_device.h"
+#include "pdi_device_internal.h"
+
+/*
+ * Secondary indexes.
+ *
+ * Besides their address hash, linked devices are indexed by:
+ * - subnet: a crit-bit tree on the address in host byte order. Internal
+ *   nodes hold the highest bit their two subtrees differ at, so that the
+ *   devices of a prefix are the leaves of a single subtree, in address
+ *   order,
+ * - MAC address: hash buckets chaining the devices of each MAC, one per
+ *   address the MAC has been seen with,
+ * - metadata: for each metadata, groups of the identified devices sharing
+ *   a value ID, kept in an open addressing table of the value IDs met.
+ * Nodes and links live in arrays reserved along with the device entries:
+ * indexing a device allocates nothing but, the first time a value ID is
+ * met, its group. Indexes are updated under the table lock as devices are
+ * linked, identified and unlinked, and scanned under it. A scan costs the
+ * depth of the tree, a hash chain or the number of value IDs of the
+ * metadata, plus the size of the result.
+ */
+static inline uint32_t device_subnet_key(struct device_table *table, uint32_t index)
+{
+    return ntohl(table->hot[index].ip);
+}
+
+static inline void device_index_list_insert(uint32_t *head,
+                                            struct device_index_link *link,
+                                            uint32_t index)
+{
+    link[index].next = *head;
+    link[index].prev = 0;
+    if (*head) {
+        link[*head - 1].prev = index + 1;
+    }
+    *head = index + 1;
+}
+
+static inline void device_index_list_remove(uint32_t *head,
+                                            struct device_index_link *link,
+                                            uint32_t index)
+{
+    if (link[index].prev) {
+        link[link[index].prev - 1].next = link[index].next;
+    } else {
+        *head = link[index].next;
+    }
+    if (link[index].next) {
+        link[link[index].next - 1].prev = link[index].prev;
+    }
+    link[index].next = DEVICE_INDEX_UNLINKED;
+    link[index].prev = DEVICE_INDEX_UNLINKED;
+}
+
+void device_subnet_insert(struct device_table *table, uint32_t index)
+{
+    struct device_index *idx = &table->index;
+    struct device_subnet_node *node = NULL;
+    uint32_t key = device_subnet_key(table, index);
+    uint32_t *ref = &idx->subnet_root;
+    uint32_t p = idx->subnet_root;
+    uint32_t diff;
+    uint32_t bit;
+    uint32_t n;
+
+    if (p == 0) {
+        idx->subnet_root = DEVICE_SUBNET_LEAF | index;
+        return;
+    }
+
+    /* Any leaf reached following the key bits shares its longest prefix. */
+    while (!(p & DEVICE_SUBNET_LEAF)) {
+        node = &idx->subnet_node[p];
+        p = node->child[(key >> node->bit) & 1];
+    }
+
+    diff = key ^ device_subnet_key(table, p & ~DEVICE_SUBNET_LEAF);
+    if (diff == 0) {
+        return;
+    }
+    bit = 31 - __builtin_clz(diff);
+
+    while (!(*ref & DEVICE_SUBNET_LEAF) && idx->subnet_node[*ref].bit > bit) {
+        node = &idx->subnet_node[*ref];
+        ref = &node->child[(key >> node->bit) & 1];
+    }
+
+    /* There are never more internal nodes than devices. */
+    n = idx->subnet_free;
+    if (n) {
+        idx->subnet_free = idx->subnet_node[n].child[0];
+    } else {
+        n = idx->subnet_next++;
+    }
+
+    node = &idx->subnet_node[n];
+    node->bit = bit;
+    node->child[(key >> bit) & 1] = DEVICE_SUBNET_LEAF | index;
+    node->child[!((key >> bit) & 1)] = *ref;
+    *ref = n;
+}
+
+void device_subnet_remove(struct device_table *table, uint32_t index)
+{
+    struct device_index *idx = &table->index;
+    struct device_subnet_node *node = NULL;
+    uint32_t key = device_subnet_key(table, index);
+    uint32_t *ref = &idx->subnet_root;
+    uint32_t *parent_ref = NULL;
+    uint32_t parent;
+
+    if (*ref == 0) {
+        return;
+    }
+
+    while (!(*ref & DEVICE_SUBNET_LEAF)) {
+        parent_ref = ref;
+        node = &idx->subnet_node[*ref];
+        ref = &node->child[(key >> node->bit) & 1];
+    }
+
+    if (*ref != (DEVICE_SUBNET_LEAF | index)) {
+        return;
+    }
+
+    if (parent_ref == NULL) {
+        idx->subnet_root = 0;
+        return;
+    }
+
+    /* The sibling takes the place of the parent node. */
+    parent = *parent_ref;
+    node = &idx->subnet_node[parent];
+    *parent_ref = node->child[ref == &node->child[0]];
+    node->child[0] = idx->subnet_free;
+    idx->subnet_free = parent;
+}
+
+static uint32_t device_subnet_walk(struct device_table *table,
+                                   uint32_t p,
+                                   device_index_fn fn,
+                                   void *arg)
+{
+    struct device_subnet_node *node = NULL;
+
+    if (p & DEVICE_SUBNET_LEAF) {
+        fn(device_table_entry(table, p & ~DEVICE_SUBNET_LEAF), arg);
+        return 1;
+    }
+
+    node = &table->index.subnet_node[p];
+
+    return device_subnet_walk(table, node->child[0], fn, arg) +
+           device_subnet_walk(table, node->child[1], fn, arg);
+}
+
+/*
+ * Call fn for each device of prefix/len, prefix in host byte order, in
+ * address order.
+ * return the number of devices.
+ *
+ * The table lock MUST be held.
+ */
+static uint32_t device_subnet_scan(struct device_table *table,
+                                   uint32_t prefix,
+                                   unsigned int len,
+                                   device_index_fn fn,
+                                   void *arg)
+{
+    struct device_index *idx = &table->index;
+    uint32_t mask = len ? ~0u << (32 - len) : 0;
+    uint32_t p = idx->subnet_root;
+    uint32_t leaf;
+
+    if (p == 0) {
+        return 0;
+    }
+
+    /* Follow the prefix bits down to the first node that splits below it:
+     * its leaves share the prefix bits, check one of them. */
+    while (!(p & DEVICE_SUBNET_LEAF) && idx->subnet_node[p].bit >= 32 - len) {
+        p = idx->subnet_node[p].child[(prefix >> idx->subnet_node[p].bit) & 1];
+    }
+
+    for (leaf = p; !(leaf & DEVICE_SUBNET_LEAF); leaf = idx->subnet_node[leaf].child[0]);
+    if ((device_subnet_key(table, leaf & ~DEVICE_SUBNET_LEAF) & mask) != (prefix & mask)) {
+        return 0;
+    }
+
+    return device_subnet_walk(table, p, fn, arg);
+}
+
+static inline uint32_t device_mac_bucket(struct device_index *idx, const uint8_t *mac)
+{
+    return (uint32_t) __murmur_hash64(mac, 6) & idx->mac_mask;
+}
+
+/*
+ * Call fn for each device seen with MAC address mac.
+ * return the number of devices.
+ *
+ * The table lock MUST be held.
+ */
+static uint32_t device_mac_scan(struct device_table *table,
+                                const uint8_t *mac,
+                                device_index_fn fn,
+                                void *arg)
+{
+    struct device_index *idx = &table->index;
+    uint32_t i = idx->mac_bucket[device_mac_bucket(idx, mac)];
+    uint32_t nb = 0;
+
+    for (; i; i = idx->mac_link[i - 1].next) {
+        device_ip_t *device = device_table_entry(table, i - 1);
+
+        if (memcmp(device->mac_addr, mac, sizeof(device->mac_addr)) == 0) {
+            fn(device, arg);
+            nb++;
+        }
+    }
+
+    return nb;
+}
+
+static inline uint32_t device_metadata_hash(uint32_t value)
+{
+    return value * 2654435761u;
+}
+
+/*
+ * return the group of value ID value, NULL if it does not exist and can't
+ * be created.
+ */
+static struct device_metadata_group *device_metadata_group(struct device_metadata_index *mi,
+                                                           uint32_t value,
+                                                           int create)
+{
+    struct device_metadata_group *group = NULL;
+    uint32_t pos = device_metadata_hash(value) & mi->mask;
+    uint32_t i;
+
+    for (; mi->group[pos].value; pos = (pos + 1) & mi->mask) {
+        if (mi->group[pos].value == value) {
+            return &mi->group[pos];
+        }
+    }
+
+    if (!create) {
+        return NULL;
+    }
+
+    /* Keep the table at most half full. */
+    if ((mi->nb + 1) * 2 > mi->mask + 1) {
+        struct device_metadata_index grown = *mi;
+
+        grown.mask = (mi->mask << 1) | 1;
+        grown.group = calloc(grown.mask + 1, sizeof(*grown.group));
+        if (grown.group == NULL) {
+            fprintf(stderr, "ERROR: can't grow device metadata index\n");
+            return NULL;
+        }
+
+        for (i = 0; i <= mi->mask; i++) {
+            if (mi->group[i].value) {
+                pos = device_metadata_hash(mi->group[i].value) & grown.mask;
+                while (grown.group[pos].value) {
+                    pos = (pos + 1) & grown.mask;
+                }
+                grown.group[pos] = mi->group[i];
+            }
+        }
+
+        free(mi->group);
+        *mi = grown;
+
+        for (pos = device_metadata_hash(value) & mi->mask; mi->group[pos].value;
+             pos = (pos + 1) & mi->mask);
+    }
+
+    group = &mi->group[pos];
+    group->value = value;
+    mi->nb++;
+
+    return group;
+}
+
+/*
+ * Index an identified device by its metadata value IDs.
+ *
+ * The table lock MUST be held.
+ */
+void device_index_metadata_add(struct device_table *table,
+                               device_ip_t *device)
+{
+    uint32_t index = device_table_index(table, device);
+    unsigned int id;
+
+    for (id = 0; id < QMDEV_MAX_METADATA_ID; id++) {
+        struct device_metadata_index *mi = &table->index.metadata[id];
+        struct device_metadata_group *group = NULL;
+
+        if (device->metadata_id[id]) {
+            group = device_metadata_group(mi, device->metadata_id[id], 1);
+        }
+
+        if (group == NULL) {
+            mi->link[index].next = DEVICE_INDEX_UNLINKED;
+            mi->link[index].prev = DEVICE_INDEX_UNLINKED;
+            continue;
+        }
+
+        device_index_list_insert(&group->head, mi->link, index);
+        group->nb++;
+    }
+}
+
+/*
+ * The table lock MUST be held.
+ */
+void device_index_metadata_remove(struct device_table *table,
+                                  device_ip_t *device)
+{
+    uint32_t index = device_table_index(table, device);
+    unsigned int id;
+
+    for (id = 0; id < QMDEV_MAX_METADATA_ID; id++) {
+        struct device_metadata_index *mi = &table->index.metadata[id];
+        struct device_metadata_group *group = NULL;
+
+        if (mi->link[index].prev == DEVICE_INDEX_UNLINKED) {
+            continue;
+        }
+
+        group = device_metadata_group(mi, device->metadata_id[id], 0);
+        device_index_list_remove(&group->head, mi->link, index);
+        group->nb--;
+    }
+}
+
+/*
+ * Index a linked device by its MAC address, if it has one.
+ *
+ * The table lock MUST be held.
+ */
+void device_index_mac_add(struct device_table *table,
+                          device_ip_t *device)
+{
+    struct device_index *idx = &table->index;
+    uint32_t index = device_table_index(table, device);
+
+    if (device_mac_is_set(device->mac_addr)) {
+        device_index_list_insert(&idx->mac_bucket[device_mac_bucket(idx, device->mac_addr)],
+                                 idx->mac_link, index);
+    } else {
+        idx->mac_link[index].next = DEVICE_INDEX_UNLINKED;
+        idx->mac_link[index].prev = DEVICE_INDEX_UNLINKED;
+    }
+}
+
+/*
+ * Remove a linked device from the MAC address index, before its MAC
+ * address changes or it is unlinked.
+ *
+ * The table lock MUST be held.
+ */
+void device_index_mac_remove(struct device_table *table,
+                             device_ip_t *device)
+{
+    struct device_index *idx = &table->index;
+    uint32_t index = device_table_index(table, device);
+
+    if (idx->mac_link[index].prev != DEVICE_INDEX_UNLINKED) {
+        device_index_list_remove(&idx->mac_bucket[device_mac_bucket(idx, device->mac_addr)],
+                                 idx->mac_link, index);
+    }
+}
+
+/*
+ * Index a device that has just been linked.
+ *
+ * The table lock MUST be held.
+ */
+void device_index_add(struct device_table *table,
+                      device_ip_t *device)
+{
+    struct device_index *idx = &table->index;
+    uint32_t index = device_table_index(table, device);
+    unsigned int id;
+
+    device_subnet_insert(table, index);
+
+    device_index_mac_add(table, device);
+
+    if (__atomic_load_n(&table->hot[index].state, __ATOMIC_RELAXED) & DEVICE_STATE_IDENTIFIED) {
+        device_index_metadata_add(table, device);
+    } else {
+        for (id = 0; id < QMDEV_MAX_METADATA_ID; id++) {
+            idx->metadata[id].link[index].next = DEVICE_INDEX_UNLINKED;
+            idx->metadata[id].link[index].prev = DEVICE_INDEX_UNLINKED;
+        }
+    }
+}
+
+/*
+ * The table lock MUST be held.
+ */
+void device_index_remove(struct device_table *table,
+                         device_ip_t *device)
+{
+    device_subnet_remove(table, device_table_index(table, device));
+    device_index_mac_remove(table, device);
+    device_index_metadata_remove(table, device);
+}
+
+/*
+ * Call fn for each identified device the metadata id of which is value,
+ * compared without case.
+ * return the number of devices.
+ *
+ * The table lock MUST be held.
+ */
+static uint32_t device_metadata_scan(struct device_table *table,
+                                     enum qmdev_metadata_identifier id,
+                                     const char *value,
+                                     device_index_fn fn,
+                                     void *arg)
+{
+    struct device_metadata_index *mi = &table->index.metadata[id];
+    size_t value_len = strlen(value);
+    uint32_t nb = 0;
+    uint32_t pos;
+    uint32_t i;
+
+    for (pos = 0; pos <= mi->mask; pos++) {
+        struct device_metadata_group *group = &mi->group[pos];
+        const char *str = NULL;
+        unsigned int len = 0;
+
+        if (group->value == 0 || group->nb == 0) {
+            continue;
+        }
+
+        if (id == QMDEV_OS_VERSION) {
+            str = device_os_version_str(group->value);
+            len = strlen(str);
+        } else if (qmdev_device_metadata_get_byid(id, group->value, &str, &len) != QMDEV_SUCCESS ||
+                   str == NULL) {
+            continue;
+        }
+
+        if (len != value_len || strncasecmp(str, value, len)) {
+            continue;
+        }
+
+        for (i = group->head; i; i = mi->link[i - 1].next) {
+            fn(device_table_entry(table, i - 1), arg);
+            nb++;
+        }
+    }
+
+    return nb;
+}
+
+static const struct {
+    const char *name;
+    enum qmdev_metadata_identifier id;
+} device_metadata_names[] = {
+    { "vendor",     QMDEV_VENDOR },
+    { "model",      QMDEV_MODEL },
+    { "type",       QMDEV_TYPE },
+    { "os_vendor",  QMDEV_OS_VENDOR },
+    { "os",         QMDEV_OS },
+    { "os_version", QMDEV_OS_VERSION },
+    { "nic",        QMDEV_NIC_VENDOR },
+};
+
+/*
+ * Parse a device selector, one of:
+ * - a.b.c.d[/len]: devices of a subnet,
+ * - mac=<xx:xx:xx:xx:xx:xx>: devices seen with a MAC address,
+ * - <metadata>=<value>: identified devices of a metadata value, metadata
+ *   being one of device_metadata_names.
+ * A NULL selector selects all devices.
+ *
+ * return 0 on success, -1 on failure.
+ */
+int device_select_parse(const char *selector, struct device_select *select)
+{
+    const char *value = NULL;
+    char addr_str[INET_ADDRSTRLEN];
+    struct in_addr addr;
+    unsigned int i;
+    int n = 0;
+
+    memset(select, 0, sizeof(*select));
+    if (selector == NULL) {
+        return 0;
+    }
+
+    value = strchr(selector, '=');
+    if (value) {
+        value++;
+        if (strncmp(selector, "mac=", 4) == 0) {
+            select->kind = DEVICE_SELECT_MAC;
+            if (sscanf(value, MAC_FMT "%n", &select->mac[0], &select->mac[1], &select->mac[2],
+                       &select->mac[3], &select->mac[4], &select->mac[5], &n) == 6 &&
+                value[n] == '\0') {
+                return 0;
+            }
+        } else {
+            for (i = 0; i < ARRAY_SIZE(device_metadata_names); i++) {
+                if (strlen(device_metadata_names[i].name) == (size_t) (value - 1 - selector) &&
+                    strncmp(selector, device_metadata_names[i].name, value - 1 - selector) == 0 &&
+                    value[0]) {
+                    select->kind = DEVICE_SELECT_METADATA;
+                    select->id = device_metadata_names[i].id;
+                    select->value = value;
+                    return 0;
+                }
+            }
+        }
+    } else {
+        const char *len_str = strchr(selector, '/');
+        size_t addr_len = len_str ? (size_t) (len_str - selector) : strlen(selector);
+
+        select->kind = DEVICE_SELECT_SUBNET;
+        select->len = 32;
+        if (addr_len < sizeof(addr_str)) {
+            memcpy(addr_str, selector, addr_len);
+            addr_str[addr_len] = '\0';
+            if (inet_pton(AF_INET, addr_str, &addr) == 1 &&
+                (len_str == NULL ||
+                 (sscanf(len_str, "/%u%n", &select->len, &n) == 1 && len_str[n] == '\0' &&
+                  select->len <= 32))) {
+                select->prefix = ntohl(addr.s_addr);
+                return 0;
+            }
+        }
+    }
+
+    fprintf(stderr, "ERROR: invalid device selector %s, expected a.b.c.d[/len], "
+                    "mac=<address> or <metadata>=<value> with metadata one of", selector);
+    for (i = 0; i < ARRAY_SIZE(device_metadata_names); i++) {
+        fprintf(stderr, " %s", device_metadata_names[i].name);
+    }
+    fprintf(stderr, "\n");
+
+    return -1;
+}
+
+/*
+ * Call fn for each device of a selector.
+ * return the number of devices.
+ *
+ * The table lock MUST be held.
+ */
+uint32_t device_select_scan(struct device_table *table,
+                            const struct device_select *select,
+                            device_index_fn fn,
+                            void *arg)
+{
+    switch (select->kind) {
+        case DEVICE_SELECT_SUBNET:
+            return device_subnet_scan(table, select->prefix, select->len, fn, arg);
+        case DEVICE_SELECT_MAC:
+            return device_mac_scan(table, select->mac, fn, arg);
+        case DEVICE_SELECT_METADATA:
+            return device_metadata_scan(table, select->id, select->value, fn, arg);
+        default:
+            return device_subnet_scan(table, 0, 0, fn, arg);
+    }
+}
+
+void device_index_exit(struct device_table *table)
+{
+    struct device_index *idx = &table->index;
+    unsigned int id;
+
+    if (idx->subnet_node) {
+        munmap(idx->subnet_node, ((size_t) table->max_entries + 1) * sizeof(*idx->subnet_node));
+    }
+    if (idx->mac_bucket) {
+        munmap(idx->mac_bucket, ((size_t) idx->mac_mask + 1) * sizeof(*idx->mac_bucket));
+    }
+    if (idx->mac_link) {
+        munmap(idx->mac_link, (size_t) table->max_entries * sizeof(*idx->mac_link));
+    }
+    for (id = 0; id < QMDEV_MAX_METADATA_ID; id++) {
+        if (idx->metadata[id].link) {
+            munmap(idx->metadata[id].link, (size_t) table->max_entries * sizeof(*idx->metadata[id].link));
+        }
+        free(idx->metadata[id].group);
+    }
+
+    memset(idx, 0, sizeof(*idx));
+}
+
+/*
+ * Reserve the secondary indexes of max_entries devices.
+ * return 0 on success, -1 on failure.
+ */
+int device_index_init(struct device_table *table, int prewarm)
+{
+    struct device_index *idx = &table->index;
+    uint32_t nb_buckets = DEVICE_SLOTS_MIN;
+    unsigned int id;
+    int ret = 0;
+
+    while (nb_buckets < table->max_entries) {
+        nb_buckets <<= 1;
+    }
+
+    memset(idx, 0, sizeof(*idx));
+    idx->subnet_next = 1;
+    idx->mac_mask = nb_buckets - 1;
+
+    idx->subnet_node = device_table_map(table->max_entries + 1, sizeof(*idx->subnet_node), prewarm);
+    idx->mac_bucket = device_table_map(nb_buckets, sizeof(*idx->mac_bucket), prewarm);
+    idx->mac_link = device_table_map(table->max_entries, sizeof(*idx->mac_link), prewarm);
+    if (idx->subnet_node == NULL || idx->mac_bucket == NULL || idx->mac_link == NULL) {
+        ret = -1;
+    }
+
+    for (id = 0; id < QMDEV_MAX_METADATA_ID; id++) {
+        struct device_metadata_index *mi = &idx->metadata[id];
+
+        mi->mask = DEVICE_METADATA_GROUPS_MIN - 1;
+        mi->group = calloc(DEVICE_METADATA_GROUPS_MIN, sizeof(*mi->group));
+        mi->link = device_table_map(table->max_entries, sizeof(*mi->link), prewarm);
+        if (mi->group == NULL || mi->link == NULL) {
+            ret = -1;
+        }
+    }
+
+    if (ret < 0) {
+        device_index_exit(table);
+    }
+
+    return ret;
+}
@@ -0,0 +1,263 @@
+/*
+  This file is a part of Qosmos Device Identification library
+
+  Copyright Qosmos Tech 2000-2018 - All rights reserved
+
+  This computer program and all its components are protected by
+  authors' rights and copyright law and by international treaties.
+  Any representation, reproduction, distribution or modification
+  of this program or any portion of it is forbidden without
+  Qosmos explicit and written agreement and may result in severe
+  civil and criminal penalties, and will be prosecuted
+  to the maximum extent possible under the law.
+*/
+
+/*
+ * Device table internals, shared by the pdi_device*.c files only: other
+ * modules use pdi_device.h.
+ */
+
+#ifndef _PDI_DEVICE_INTERNAL_H_
+#define _PDI_DEVICE_INTERNAL_H_
+
+#include <sys/queue.h>
+
+#define DEVICE_SLOT_INDEX_BITS  24
+#define DEVICE_SLOT_INDEX_MASK  ((1u << DEVICE_SLOT_INDEX_BITS) - 1)
+#define DEVICE_SLOT_DIST_MAX    0xffu
+#define DEVICE_ENTRY_DIST(e)    ((e) >> DEVICE_SLOT_INDEX_BITS)
+#define DEVICE_ENTRY_INDEX(e)   ((e) & DEVICE_SLOT_INDEX_MASK)
+#define DEVICE_SLOT_DIST(s)     DEVICE_ENTRY_DIST((s)->entry)
+#define DEVICE_SLOT_INDEX(s)    DEVICE_ENTRY_INDEX((s)->entry)
+#define DEVICE_SLOT_ENTRY(dist, index) (((uint32_t) (dist) << DEVICE_SLOT_INDEX_BITS) | (index))
+
+#define DEVICE_MAX_ENTRIES      DEVICE_SLOT_INDEX_MASK
+
+#define DEVICE_SLOTS_MIN        1024
+#define DEVICE_LOAD_MIN         25
+#define DEVICE_LOAD_MAX         90
+
+/* Timing wheel: the idle timeout spans at most DEVICE_WHEEL_SPAN ticks and
+ * the wheel lags at most DEVICE_WHEEL_LAG ticks behind packet time, so that
+ * a device is never linked a full turn ahead. */
+#define DEVICE_WHEEL_SZ         1024
+#define DEVICE_WHEEL_SPAN       256
+#define DEVICE_WHEEL_LAG        512
+
+/* Interned OS versions, see device_os_version_intern(). */
+#define DEVICE_OS_VERSION_MAX   4096
+#define DEVICE_OS_VERSION_SZ    32
+#define DEVICE_OS_VERSION_HASHSZ (2 * DEVICE_OS_VERSION_MAX)
+
+/* Secondary indexes, see device_index_add(). List links and heads hold an
+ * entry index plus one, 0 ends a list. */
+#define DEVICE_INDEX_UNLINKED   UINT32_MAX      /* not in a list */
+#define DEVICE_SUBNET_LEAF      0x80000000u
+#define DEVICE_METADATA_GROUPS_MIN 256
+
+struct device_hot {
+    uint32_t ip;
+    uint8_t  state;     /* DEVICE_STATE_*, accessed atomically */
+    uint8_t  reserved[3];
+    time_t   last_seen; /* packet time, accessed atomically */
+};
+
+struct device_slot {
+    uint32_t ip;        /* 0: empty slot */
+    uint32_t entry;     /* probe distance and device entry index */
+};
+
+struct device_slot_array {
+    SLIST_ENTRY(device_slot_array) next;    /* retired arrays */
+    uint32_t            mask;
+    struct device_slot  slot[];
+};
+
+struct device_slots {
+    struct device_slot_array *array;        /* NULL if none */
+    uint32_t            nb_entries;
+};
+
+LIST_HEAD(device_wheel_bucket, device_ip);
+
+struct device_index_link {
+    uint32_t next;
+    uint32_t prev;      /* 0: first of its list */
+};
+
+struct device_subnet_node {
+    uint32_t child[2];  /* node index, or DEVICE_SUBNET_LEAF | entry index */
+    uint32_t bit;       /* highest bit the subtrees differ at */
+};
+
+struct device_metadata_group {
+    uint32_t value;     /* value ID, 0: empty */
+    uint32_t head;
+    uint32_t nb;
+};
+
+struct device_metadata_index {
+    uint32_t            mask;
+    uint32_t            nb;
+    struct device_metadata_group *group;
+    struct device_index_link *link;
+};
+
+struct device_index {
+    uint32_t            subnet_root;    /* 0: empty */
+    struct device_subnet_node *subnet_node; /* node 0 unused */
+    uint32_t            subnet_free;    /* free nodes, chained by child[0] */
+    uint32_t            subnet_next;    /* first never used node */
+    uint32_t            mac_mask;
+    uint32_t           *mac_bucket;
+    struct device_index_link *mac_link;
+    struct device_metadata_index metadata[QMDEV_MAX_METADATA_ID];
+};
+
+struct device_table {
+    unsigned int        seq;            /* odd while slots are modified */
+    struct device_slots cur;
+    struct device_slots old;            /* being migrated, array NULL if none */
+    uint32_t            rehash_index;   /* next old slot to migrate */
+    unsigned int        load;           /* max slot occupancy, in percent */
+    uint32_t            max_entries;
+    struct device_hot  *hot;
+    device_ip_t        *cold;
+    uint32_t            next_index;     /* first never used entry index */
+    SLIST_HEAD(, device_ip) free_entries;
+    uint32_t            nb_used;        /* entries not on the free list */
+    uint64_t            nb_exhausted;   /* creations failed for lack of entry */
+    uint32_t            nb_contexts;    /* devices with a device context */
+    uint64_t            nb_contexts_failed; /* attachments failed */
+    int                 contexts_short; /* failure reported, until one succeeds */
+    uint64_t            nb_grow;
+    uint64_t            nb_shrink;
+    time_t              now;            /* packet time of the last maintenance */
+    unsigned int        idle;           /* idle timeout, in seconds */
+    unsigned int        tick_sec;       /* wheel tick length, in seconds */
+    uint64_t            wheel_tick;     /* next tick to expire, 0 until started */
+    struct device_wheel_bucket wheel[DEVICE_WHEEL_SZ];
+    uint64_t            nb_idle;
+    uint64_t            nb_lru;
+    struct device_index index;
+    pthread_mutex_t     lock;           /* writers */
+};
+
+/*
+ * Device selectors, see device_select_parse().
+ */
+enum device_select_kind {
+    DEVICE_SELECT_ALL = 0,
+    DEVICE_SELECT_SUBNET,
+    DEVICE_SELECT_MAC,
+    DEVICE_SELECT_METADATA,
+};
+
+struct device_select {
+    enum device_select_kind kind;
+    uint32_t            prefix;         /* host byte order */
+    unsigned int        len;
+    uint8_t             mac[6];
+    enum qmdev_metadata_identifier id;
+    const char         *value;
+};
+
+typedef void (*device_index_fn)(device_ip_t *device, void *arg);
+
+extern struct device_table device_table;
+
+static inline uint32_t get_ip_address_hash_key(uint32_t ip)
+{
+    return (uint32_t) __murmur_hash64((uint8_t*)&(ip), sizeof(uint32_t));
+}
+
+static inline device_ip_t *device_table_entry(struct device_table *table, uint32_t index)
+{
+    return &table->cold[index];
+}
+
+static inline uint32_t device_table_index(struct device_table *table, device_ip_t *device)
+{
+    return device - table->cold;
+}
+
+static inline struct device_hot *device_hot(device_ip_t *device)
+{
+    return &device_table.hot[device_table_index(&device_table, device)];
+}
+
+static inline void device_table_write_begin(struct device_table *table)
+{
+    __atomic_store_n(&table->seq, table->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void device_table_write_end(struct device_table *table)
+{
+    __atomic_store_n(&table->seq, table->seq + 1, __ATOMIC_RELEASE);
+}
+
+static inline uint32_t device_table_nb_entries(struct device_table *table)
+{
+    return table->cur.nb_entries + table->old.nb_entries;
+}
+
+static inline int device_mac_is_set(const uint8_t *mac)
+{
+    return mac[0] | mac[1] | mac[2] | mac[3] | mac[4] | mac[5];
+}
+
+/* pdi_device.c */
+struct device_slot *device_table_lookup(struct device_table *table,
+                                        uint32_t ip,
+                                        uint32_t hash_key,
+                                        struct device_slots **slots);
+int device_slots_insert(struct device_slots *slots,
+                        uint32_t ip,
+                        uint32_t hash_key,
+                        uint32_t index);
+struct device_slot_array *device_slot_array_alloc(uint32_t nb_slots);
+void device_slot_array_retire(struct device_slot_array *array);
+void device_table_balance(struct device_table *table);
+void device_wheel_link(struct device_table *table,
+                       device_ip_t *device);
+device_ip_t *device_table_entry_alloc(struct device_table *table, uint32_t ip);
+void device_table_entry_release(struct device_table *table,
+                                device_ip_t *device);
+void *device_table_map(uint32_t nb, size_t size, int prewarm);
+uint32_t device_os_version_intern(const char *version);
+const char *device_os_version_str(uint32_t index);
+
+/* pdi_device_index.c */
+int device_index_init(struct device_table *table, int prewarm);
+void device_index_exit(struct device_table *table);
+void device_subnet_insert(struct device_table *table, uint32_t index);
+void device_subnet_remove(struct device_table *table, uint32_t index);
+void device_index_mac_add(struct device_table *table,
+                          device_ip_t *device);
+void device_index_mac_remove(struct device_table *table,
+                             device_ip_t *device);
+void device_index_metadata_add(struct device_table *table,
+                               device_ip_t *device);
+void device_index_metadata_remove(struct device_table *table,
+                                  device_ip_t *device);
+void device_index_add(struct device_table *table,
+                      device_ip_t *device);
+void device_index_remove(struct device_table *table,
+                         device_ip_t *device);
+int device_select_parse(const char *selector, struct device_select *select);
+uint32_t device_select_scan(struct device_table *table,
+                            const struct device_select *select,
+                            device_index_fn fn,
+                            void *arg);
+
+/* pdi_device_filter.c */
+int device_filter_init(const char *ranges);
+void device_filter_exit(void);
+void device_filter_report(void);
+int device_filter_mark(uint32_t ip);
+void device_filter_clear(uint32_t ip);
+void device_filter_set(device_ip_t *device);
+int device_filter_seen(struct device_table *table, device_ip_t *device);
+
+#endif /* _PDI_DEVICE_INTERNAL_H_ */
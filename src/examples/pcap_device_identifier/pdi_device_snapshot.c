@@ -0,0 +1,360 @@
+/*
+  This file is a part of Qosmos Device Identification library
+
+  Copyright Qosmos Tech 2000-2018 - All rights reserved
+
+  This computer program and all its components are protected by
+  authors' rights and copyright law and by international treaties.
+  Any representation, reproduction, distribution or modification
+  of this program or any portion of it is forbidden without
+  Qosmos explicit and written agreement and may result in severe
+  civil and criminal penalties, and will be prosecuted
+  to the maximum extent possible under the law.
+*/
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <sys/queue.h>
+
+#include "qmdpi.h"
+#include "qmdevice.h"
+
+#include "pdi_common.h"
+#include "pdi_utils.h"
+
+#include "pdi_device.h"
+#include "pdi_device_internal.h"
+
+/*
+ * Device table snapshots.
+ *
+ * Identified devices are saved to a flat file: a header followed by
+ * fixed-size records, in host byte order. The file is written aside and
+ * renamed over the previous snapshot, so a crash never leaves a truncated
+ * one. At start-up it is mapped and its devices are inserted back as
+ * identified, without device context: the dispatcher drops their traffic
+ * right away.
+ */
+#define DEVICE_SNAPSHOT_MAGIC   0x53494450u /* "PDIS" */
+#define DEVICE_SNAPSHOT_VERSION 2
+
+/* Entries copied per table lock hold. */
+#define DEVICE_SNAPSHOT_CHUNK_SZ 1024
+
+struct device_snapshot_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t nb_records;
+    uint32_t reserved;
+    int64_t  saved_time;
+};
+
+struct device_snapshot_record {
+    int64_t  detected_time;
+    int64_t  last_seen;
+    uint32_t ip_addr;
+    uint8_t  mac_addr[6];
+    uint8_t  state;
+    uint8_t  reserved;
+    uint32_t score;
+    uint32_t flags;
+    uint32_t metadata_id[QMDEV_MAX_METADATA_ID]; /* OS version slot unused */
+    char     os_version[DEVICE_OS_VERSION_SZ];
+};
+
+/* A save from the device thread may race the one done at exit. */
+static pthread_mutex_t device_snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Copy the identified devices of a chunk of entries to records.
+ * return the number of records written, at most nb.
+ *
+ * The table lock MUST be held.
+ */
+static uint32_t device_snapshot_chunk(struct device_table *table,
+                                      uint32_t chunk,
+                                      struct device_snapshot_record *record,
+                                      uint32_t nb)
+{
+    uint32_t index = chunk * DEVICE_SNAPSHOT_CHUNK_SZ;
+    uint32_t end = index + DEVICE_SNAPSHOT_CHUNK_SZ;
+    uint32_t n = 0;
+
+    if (end > table->next_index) {
+        end = table->next_index;
+    }
+
+    for (; index < end && n < nb; index++) {
+        struct device_hot *hot = &table->hot[index];
+        device_ip_t *device = device_table_entry(table, index);
+        uint8_t state = __atomic_load_n(&hot->state, __ATOMIC_ACQUIRE);
+
+        /* Skip free and retired entries. Identification results do not
+         * change once published. */
+        if ((state & (DEVICE_STATE_IDENTIFIED | DEVICE_STATE_LINKED)) !=
+            (DEVICE_STATE_IDENTIFIED | DEVICE_STATE_LINKED)) {
+            continue;
+        }
+
+        memset(&record[n], 0, sizeof(record[n]));
+        record[n].detected_time = device->detected_time;
+        record[n].last_seen = __atomic_load_n(&hot->last_seen, __ATOMIC_RELAXED);
+        record[n].ip_addr = hot->ip;
+        memcpy(record[n].mac_addr, device->mac_addr, sizeof(record[n].mac_addr));
+        record[n].state = state & ~DEVICE_STATE_LINKED;
+        record[n].score = device->score;
+        record[n].flags = device->flags;
+        memcpy(record[n].metadata_id, device->metadata_id, sizeof(record[n].metadata_id));
+        record[n].metadata_id[QMDEV_OS_VERSION] = 0;
+        strcpy(record[n].os_version, device_os_version_str(device->metadata_id[QMDEV_OS_VERSION]));
+        n++;
+    }
+
+    return n;
+}
+
+/*
+ * Save identified devices to path.
+ * The table lock is only held one chunk of entries at a time.
+ *
+ * return 0 on success, -1 on failure.
+ */
+int pdi_device_table_save(const char *path)
+{
+    struct device_table *table = &device_table;
+    struct device_snapshot_header header;
+    struct device_snapshot_record *records = NULL;
+    char tmp_path[PATH_MAX];
+    uint32_t nb_max;
+    uint32_t nb = 0;
+    uint32_t chunk;
+    FILE *out = NULL;
+    int ret = -1;
+
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int) sizeof(tmp_path)) {
+        fprintf(stderr, "ERROR: snapshot path too long: %s\n", path);
+        return -1;
+    }
+
+    pthread_mutex_lock(&device_snapshot_lock);
+
+    nb_max = __atomic_load_n(&table->max_entries, __ATOMIC_RELAXED);
+    records = malloc((size_t) (nb_max ? nb_max : 1) * sizeof(*records));
+    if (records == NULL) {
+        fprintf(stderr, "ERROR: can't allocate device snapshot\n");
+        goto exit;
+    }
+
+    for (chunk = 0; nb < nb_max; chunk++) {
+        pthread_mutex_lock(&table->lock);
+        if (chunk * DEVICE_SNAPSHOT_CHUNK_SZ >= table->next_index) {
+            pthread_mutex_unlock(&table->lock);
+            break;
+        }
+        nb += device_snapshot_chunk(table, chunk, &records[nb], nb_max - nb);
+        pthread_mutex_unlock(&table->lock);
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic = DEVICE_SNAPSHOT_MAGIC;
+    header.version = DEVICE_SNAPSHOT_VERSION;
+    header.record_size = sizeof(struct device_snapshot_record);
+    header.nb_records = nb;
+    header.saved_time = time(NULL);
+
+    out = fopen(tmp_path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "ERROR: can't open %s: %s\n", tmp_path, strerror(errno));
+        goto exit;
+    }
+
+    if (fwrite(&header, sizeof(header), 1, out) != 1 ||
+        (nb && fwrite(records, sizeof(*records), nb, out) != nb) ||
+        fflush(out) || fsync(fileno(out))) {
+        fprintf(stderr, "ERROR: can't write %s: %s\n", tmp_path, strerror(errno));
+        fclose(out);
+        unlink(tmp_path);
+        goto exit;
+    }
+
+    if (fclose(out) || rename(tmp_path, path)) {
+        fprintf(stderr, "ERROR: can't save %s: %s\n", path, strerror(errno));
+        unlink(tmp_path);
+        goto exit;
+    }
+
+    DBG_PRINTF_1("Device table: %u devices saved to %s\n", nb, path);
+    ret = 0;
+
+exit:
+    pthread_mutex_unlock(&device_snapshot_lock);
+    free(records);
+
+    return ret;
+}
+
+/*
+ * Insert a device restored from a snapshot.
+ * return 0 on success, -1 if all device entries are in use.
+ *
+ * The table lock MUST be held, within a write section. The slot array
+ * MUST have been sized for the snapshot: it is not resized.
+ */
+static int device_snapshot_restore(struct device_table *table,
+                                   const struct device_snapshot_record *record)
+{
+    uint32_t hash_key = get_ip_address_hash_key(record->ip_addr);
+    struct device_slots *slots = NULL;
+    struct device_hot *hot = NULL;
+    device_ip_t *device = NULL;
+
+    if (device_table_lookup(table, record->ip_addr, hash_key, &slots)) {
+        return 0;
+    }
+
+    device = device_table_entry_alloc(table, record->ip_addr);
+    if (device == NULL) {
+        return -1;
+    }
+    hot = device_hot(device);
+
+    memcpy(device->mac_addr, record->mac_addr, sizeof(device->mac_addr));
+    device->score = record->score;
+    device->flags = record->flags;
+    device->detected_time = record->detected_time;
+    /* Its last packet time predates the restart: idle from the restart on,
+     * from the first packet if the wheel did not start yet. */
+    hot->last_seen = table->now;
+    memcpy(device->metadata_id, record->metadata_id, sizeof(device->metadata_id));
+    device->metadata_id[QMDEV_OS_VERSION] = device_os_version_intern(record->os_version);
+    hot->state = record->state & (DEVICE_STATE_IDENTIFIED | DEVICE_STATE_MAC_SENT);
+    if (device_mac_is_set(device->mac_addr)) {
+        hot->state |= DEVICE_STATE_MAC_LEARNT;
+    }
+
+    if (device_slots_insert(&table->cur, record->ip_addr, hash_key, device_table_index(table, device)) < 0) {
+        device_table_entry_release(table, device);
+        fprintf(stderr, "ERROR: device table probe sequence too long for " IP4_FMT "\n",
+                IP4_FMT_ARGS(record->ip_addr));
+        return 0;
+    }
+
+    hot->state |= DEVICE_STATE_LINKED;
+    device_index_add(table, device);
+    device_wheel_link(table, device);
+    device_filter_mark(record->ip_addr);
+
+    return 0;
+}
+
+/*
+ * Restore the devices saved to path by pdi_device_table_save().
+ * A missing file is not an error: there is nothing to restore on first
+ * start.
+ *
+ * return the number of devices restored, -1 on failure.
+ */
+int pdi_device_table_load(const char *path)
+{
+    struct device_table *table = &device_table;
+    const struct device_snapshot_header *header = NULL;
+    const struct device_snapshot_record *record = NULL;
+    uint64_t start = pdi_clock_ns(CLOCK_MONOTONIC);
+    uint32_t nb_slots = DEVICE_SLOTS_MIN;
+    uint32_t nb = 0;
+    uint32_t i;
+    struct stat st;
+    void *map = NULL;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        fprintf(stderr, "ERROR: can't open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(*header)) {
+        fprintf(stderr, "ERROR: %s is not a device snapshot\n", path);
+        close(fd);
+        return -1;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "ERROR: can't map %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    header = map;
+    record = (const struct device_snapshot_record *) (header + 1);
+    if (header->magic != DEVICE_SNAPSHOT_MAGIC ||
+        header->version != DEVICE_SNAPSHOT_VERSION ||
+        header->record_size != sizeof(*record) ||
+        (uint64_t) st.st_size < sizeof(*header) + (uint64_t) header->nb_records * sizeof(*record)) {
+        fprintf(stderr, "ERROR: %s: unsupported or truncated device snapshot\n", path);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    pthread_mutex_lock(&table->lock);
+    device_table_write_begin(table);
+
+    /* Size the empty table for the whole snapshot at once rather than
+     * growing it step by step. */
+    while ((uint64_t) nb_slots * table->load < (uint64_t) header->nb_records * 100 &&
+           nb_slots <= DEVICE_MAX_ENTRIES) {
+        nb_slots <<= 1;
+    }
+    if (device_table_nb_entries(table) == 0 && table->old.array == NULL &&
+        nb_slots > table->cur.array->mask + 1) {
+        struct device_slot_array *array = device_slot_array_alloc(nb_slots);
+
+        if (array) {
+            device_slot_array_retire(table->cur.array);
+            __atomic_store_n(&table->cur.array, array, __ATOMIC_RELAXED);
+        }
+    }
+
+    for (i = 0; i < header->nb_records; i++) {
+        if (record[i].ip_addr == 0 || !(record[i].state & DEVICE_STATE_IDENTIFIED) ||
+            !scope_match(record[i].ip_addr)) {
+            continue;
+        }
+        if (device_snapshot_restore(table, &record[i]) < 0) {
+            break;
+        }
+        nb++;
+    }
+    device_table_balance(table);
+
+    device_table_write_end(table);
+    pthread_mutex_unlock(&table->lock);
+
+    if (i < header->nb_records) {
+        fprintf(stderr, "WARNING: %s: %u devices not restored, device table full\n",
+                path, header->nb_records - i);
+    }
+
+    printf("Device table: %u devices restored from %s in %" PRIu64 " ms\n",
+           nb, path, (pdi_clock_ns(CLOCK_MONOTONIC) - start) / 1000000);
+
+    munmap(map, st.st_size);
+
+    return nb;
+}
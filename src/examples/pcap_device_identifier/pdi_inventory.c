@@ -0,0 +1,411 @@
+/*
+  This file is a part of Qosmos Device Identification library
+
+  Copyright Qosmos Tech 2000-2018 - All rights reserved
+
+  This computer program and all its components are protected by
+  authors' rights and copyright law and by international treaties.
+  Any representation, reproduction, distribution or modification
+  of this program or any portion of it is forbidden without
+  Qosmos explicit and written agreement and may result in severe
+  civil and criminal penalties, and will be prosecuted
+  to the maximum extent possible under the law.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <arpa/inet.h>
+
+#include "pdi_common.h"
+#include "pdi_utils.h"
+
+/*
+ * Known device inventory.
+ *
+ * Devices listed in the --inventory file are already known: the dispatcher
+ * drops their traffic before any device table access. The file has one
+ * device per line, an IPv4 or MAC address optionally followed by a comma
+ * and its metadata, e.g.:
+ *
+ *   10.0.0.12,Microsoft:Windows:2016:Dell:PowerEdge R640:server:Intel
+ *   00:1b:21:3a:4f:10,printer floor 2
+ *
+ * Lines starting with '#' are ignored. MAC addresses only match packets
+ * that were not routed: the Ethernet source of the others is a router's.
+ *
+ * Addresses are kept in sorted arrays, IPv4 ones in host byte order with an
+ * index of the first address of each /16, so that a lookup only searches
+ * the addresses of its /16. The inventory is read-only once loaded, only
+ * hit counters change, from the dispatcher thread.
+ */
+
+#define INVENTORY_IP_INDEX_SHIFT 16
+#define INVENTORY_IP_INDEX_SZ    (1u << INVENTORY_IP_INDEX_SHIFT)
+#define INVENTORY_METADATA_SZ    128
+
+struct inventory_key {
+    uint64_t key;
+    uint32_t metadata;  /* offset in the metadata pool */
+};
+
+struct inventory_set {
+    uint64_t    *key;       /* sorted */
+    uint32_t    *metadata;  /* offset in the metadata pool */
+    uint32_t    *hits;
+    uint32_t     nb;
+};
+
+static struct {
+    struct inventory_set ip;
+    struct inventory_set mac;
+    uint32_t    *ip_index;  /* first IP of each /16, INVENTORY_IP_INDEX_SZ + 1 */
+    char        *metadata;
+    size_t       metadata_len;
+    uint64_t     hits;
+} inventory;
+
+static int inventory_key_cmp(const void *a, const void *b)
+{
+    const struct inventory_key *ka = a;
+    const struct inventory_key *kb = b;
+
+    if (ka->key != kb->key) {
+        return ka->key < kb->key ? -1 : 1;
+    }
+
+    /* Keep the same duplicate whatever the qsort() implementation. */
+    return ka->metadata < kb->metadata ? -1 : ka->metadata > kb->metadata;
+}
+
+static int inventory_parse_mac(const char *str, uint64_t *mac)
+{
+    uint8_t m[6];
+    char end;
+    int i;
+
+    if (sscanf(str, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx%c",
+               &m[0], &m[1], &m[2], &m[3], &m[4], &m[5], &end) != 6) {
+        return -1;
+    }
+
+    *mac = 0;
+    for (i = 0; i < 6; i++) {
+        *mac = (*mac << 8) | m[i];
+    }
+
+    return *mac ? 0 : -1;
+}
+
+/*
+ * Sort keys, drop duplicates and build the set.
+ * return 0 on success, -1 on allocation failure.
+ */
+static int inventory_set_build(struct inventory_set *set,
+                               struct inventory_key *keys,
+                               uint32_t nb)
+{
+    uint32_t i;
+
+    if (nb == 0) {
+        return 0;
+    }
+
+    qsort(keys, nb, sizeof(*keys), inventory_key_cmp);
+
+    set->key = malloc(nb * sizeof(*set->key));
+    set->metadata = malloc(nb * sizeof(*set->metadata));
+    set->hits = calloc(nb, sizeof(*set->hits));
+    if (set->key == NULL || set->metadata == NULL || set->hits == NULL) {
+        return -1;
+    }
+
+    for (i = 0; i < nb; i++) {
+        if (set->nb && set->key[set->nb - 1] == keys[i].key) {
+            continue;
+        }
+        set->key[set->nb] = keys[i].key;
+        set->metadata[set->nb] = keys[i].metadata;
+        set->nb++;
+    }
+
+    return 0;
+}
+
+static void inventory_set_free(struct inventory_set *set)
+{
+    free(set->key);
+    free(set->metadata);
+    free(set->hits);
+    memset(set, 0, sizeof(*set));
+}
+
+/*
+ * return the index of key in set->key[first, last), -1 if it is not there.
+ */
+static inline int64_t inventory_set_search(const struct inventory_set *set,
+                                           uint64_t key,
+                                           uint32_t first,
+                                           uint32_t last)
+{
+    while (first < last) {
+        uint32_t middle = first + (last - first) / 2;
+
+        if (set->key[middle] < key) {
+            first = middle + 1;
+        } else {
+            last = middle;
+        }
+    }
+
+    return first < set->nb && set->key[first] == key ? (int64_t) first : -1;
+}
+
+static int inventory_add(struct inventory_key **keys, uint32_t *nb, uint32_t *size,
+                         uint64_t key, uint32_t metadata)
+{
+    if (*nb == *size) {
+        uint32_t new_size = *size ? *size * 2 : 1024;
+        struct inventory_key *new_keys = realloc(*keys, new_size * sizeof(**keys));
+
+        if (new_keys == NULL) {
+            return -1;
+        }
+        *keys = new_keys;
+        *size = new_size;
+    }
+
+    (*keys)[*nb].key = key;
+    (*keys)[*nb].metadata = metadata;
+    (*nb)++;
+
+    return 0;
+}
+
+/*
+ * Append a metadata string to the pool.
+ * return its offset, (uint32_t) -1 on allocation failure.
+ */
+static uint32_t inventory_metadata_add(size_t *size, const char *str)
+{
+    size_t len = strnlen(str, INVENTORY_METADATA_SZ - 1);
+    uint32_t offset = inventory.metadata_len;
+
+    if (inventory.metadata_len + len + 1 > *size) {
+        size_t new_size = *size ? *size * 2 : 65536;
+        char *pool = realloc(inventory.metadata, new_size);
+
+        if (pool == NULL) {
+            return (uint32_t) -1;
+        }
+        inventory.metadata = pool;
+        *size = new_size;
+    }
+
+    memcpy(inventory.metadata + offset, str, len);
+    inventory.metadata[offset + len] = '\0';
+    inventory.metadata_len += len + 1;
+
+    return offset;
+}
+
+/*
+ * Load the inventory file.
+ * return 0 on success, -1 on failure.
+ */
+int inventory_load(const char *path)
+{
+    struct inventory_key *ip_keys = NULL;
+    struct inventory_key *mac_keys = NULL;
+    uint32_t nb_ip = 0, size_ip = 0;
+    uint32_t nb_mac = 0, size_mac = 0;
+    size_t metadata_size = 0;
+    unsigned int line_nb = 0;
+    char line[256];
+    uint32_t i;
+    FILE *in;
+    int ret = -1;
+
+    in = fopen(path, "r");
+    if (in == NULL) {
+        fprintf(stderr, "ERROR: can't open inventory %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    /* Offset 0: no metadata. */
+    if (inventory_metadata_add(&metadata_size, "") == (uint32_t) -1) {
+        goto exit;
+    }
+
+    while (fgets(line, sizeof(line), in)) {
+        char *metadata = NULL;
+        struct in_addr addr;
+        uint32_t offset = 0;
+        uint64_t mac;
+        int err;
+
+        line_nb++;
+        if (strchr(line, '\n') == NULL && !feof(in)) {
+            int c;
+
+            /* Only metadata may be that long, it is truncated anyway. */
+            fprintf(stderr, "WARNING: inventory %s:%u: line longer than %zu characters, truncated\n",
+                    path, line_nb, sizeof(line) - 2);
+            do {
+                c = fgetc(in);
+            } while (c != EOF && c != '\n');
+        }
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+
+        metadata = strchr(line, ',');
+        if (metadata) {
+            *metadata++ = '\0';
+            offset = inventory_metadata_add(&metadata_size, metadata);
+            if (offset == (uint32_t) -1) {
+                goto alloc_error;
+            }
+        }
+
+        if (inet_pton(AF_INET, line, &addr) == 1 && addr.s_addr) {
+            err = inventory_add(&ip_keys, &nb_ip, &size_ip, ntohl(addr.s_addr), offset);
+        } else if (inventory_parse_mac(line, &mac) == 0) {
+            err = inventory_add(&mac_keys, &nb_mac, &size_mac, mac, offset);
+        } else {
+            fprintf(stderr, "WARNING: inventory %s:%u: invalid address `%s'\n", path, line_nb, line);
+            continue;
+        }
+        if (err) {
+            goto alloc_error;
+        }
+    }
+
+    if (inventory_set_build(&inventory.ip, ip_keys, nb_ip) < 0 ||
+        inventory_set_build(&inventory.mac, mac_keys, nb_mac) < 0) {
+        goto alloc_error;
+    }
+
+    if (inventory.ip.nb) {
+        uint32_t prefix = 0;
+
+        inventory.ip_index = malloc((INVENTORY_IP_INDEX_SZ + 1) * sizeof(*inventory.ip_index));
+        if (inventory.ip_index == NULL) {
+            goto alloc_error;
+        }
+        for (i = 0; i < inventory.ip.nb; i++) {
+            uint32_t p = inventory.ip.key[i] >> INVENTORY_IP_INDEX_SHIFT;
+
+            while (prefix <= p) {
+                inventory.ip_index[prefix++] = i;
+            }
+        }
+        while (prefix <= INVENTORY_IP_INDEX_SZ) {
+            inventory.ip_index[prefix++] = inventory.ip.nb;
+        }
+    }
+
+    printf("Inventory: %u IPv4 and %u MAC addresses loaded from %s\n",
+           inventory.ip.nb, inventory.mac.nb, path);
+    ret = 0;
+    goto exit;
+
+alloc_error:
+    fprintf(stderr, "ERROR: can't allocate inventory\n");
+    inventory_exit();
+exit:
+    free(ip_keys);
+    free(mac_keys);
+    fclose(in);
+
+    return ret;
+}
+
+/*
+ * Look a device up in the inventory by its IPv4 address, in network byte
+ * order, or by its MAC address if mac is not NULL.
+ * return 1 if the device is known, 0 otherwise.
+ *
+ * The function MUST be called from the packet dispatcher thread.
+ */
+int inventory_match(uint32_t ip_addr, const uint8_t *mac)
+{
+    int64_t i;
+
+    if (inventory.ip.nb && ip_addr) {
+        uint32_t ip = ntohl(ip_addr);
+        uint32_t prefix = ip >> INVENTORY_IP_INDEX_SHIFT;
+
+        i = inventory_set_search(&inventory.ip, ip, inventory.ip_index[prefix],
+                                 inventory.ip_index[prefix + 1]);
+        if (i >= 0) {
+            inventory.ip.hits[i]++;
+            inventory.hits++;
+            return 1;
+        }
+    }
+
+    if (inventory.mac.nb && mac) {
+        uint64_t key = (uint64_t) mac[0] << 40 | (uint64_t) mac[1] << 32 |
+                       (uint64_t) mac[2] << 24 | (uint64_t) mac[3] << 16 |
+                       (uint64_t) mac[4] << 8 | mac[5];
+
+        i = inventory_set_search(&inventory.mac, key, 0, inventory.mac.nb);
+        if (i >= 0) {
+            inventory.mac.hits[i]++;
+            inventory.hits++;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void inventory_report(void)
+{
+    uint32_t nb_ip = 0;
+    uint32_t nb_mac = 0;
+    uint32_t i;
+
+    if (inventory.ip.nb == 0 && inventory.mac.nb == 0) {
+        return;
+    }
+
+    for (i = 0; i < inventory.ip.nb; i++) {
+        if (inventory.ip.hits[i]) {
+            uint32_t ip = htonl((uint32_t) inventory.ip.key[i]);
+
+            nb_ip++;
+            DBG_PRINTF_1("Inventory: " IP4_FMT " %s: %u packets\n", IP4_FMT_ARGS(ip),
+                         inventory.metadata + inventory.ip.metadata[i], inventory.ip.hits[i]);
+        }
+    }
+
+    for (i = 0; i < inventory.mac.nb; i++) {
+        if (inventory.mac.hits[i]) {
+            uint64_t mac = inventory.mac.key[i];
+
+            nb_mac++;
+            DBG_PRINTF_1("Inventory: " MAC_FMT " %s: %u packets\n",
+                         (uint8_t) (mac >> 40), (uint8_t) (mac >> 32), (uint8_t) (mac >> 24),
+                         (uint8_t) (mac >> 16), (uint8_t) (mac >> 8), (uint8_t) mac,
+                         inventory.metadata + inventory.mac.metadata[i], inventory.mac.hits[i]);
+        }
+    }
+
+    printf("Inventory: packets dropped: %" PRIu64 ", IPv4 addresses seen: %u/%u"
+           ", MAC addresses seen: %u/%u\n",
+           inventory.hits, nb_ip, inventory.ip.nb, nb_mac, inventory.mac.nb);
+}
+
+void inventory_exit(void)
+{
+    inventory_set_free(&inventory.ip);
+    inventory_set_free(&inventory.mac);
+    free(inventory.ip_index);
+    free(inventory.metadata);
+    memset(&inventory, 0, sizeof(inventory));
+}
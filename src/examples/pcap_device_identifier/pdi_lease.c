@@ -0,0 +1,141 @@
+/*
+  This file is a part of Qosmos Device Identification library
+
+  Copyright Qosmos Tech 2000-2018 - All rights reserved
+
+  This computer program and all its components are protected by
+  authors' rights and copyright law and by international treaties.
+  Any representation, reproduction, distribution or modification
+  of this program or any portion of it is forbidden without
+  Qosmos explicit and written agreement and may result in severe
+  civil and criminal penalties, and will be prosecuted
+  to the maximum extent possible under the law.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "pdi_common.h"
+#include "pdi_utils.h"
+#include "pdi_device.h"
+
+/*
+ * DHCP leases.
+ *
+ * Devices are keyed by address: a client that gets another address from
+ * DHCP would otherwise start over with a new device, through DPI and
+ * identification again. The address each client hardware address, chaddr,
+ * binds in a DHCPREQUEST or DHCPACK is recorded; when it changes, the
+ * device of the previous address is moved to the new one with its
+ * identification, and the previous address is released.
+ *
+ * The device of the previous address is only moved if that address is
+ * still the client's own: the holder of each address is recorded too. A
+ * client that binds an address another client held does not inherit its
+ * device, the device is retired instead.
+ *
+ * Both bindings live in direct-mapped arrays: a binding that takes the place
+ * of another only costs a move, the client then gets a new device.
+ *
+ * Only the dispatcher thread uses the bindings: they take no lock.
+ */
+
+#define LEASE_TABLE_SZ  (1u << 16)
+
+struct lease_binding {
+    uint8_t     mac[6];
+    uint8_t     reserved[2];
+    uint32_t    ip;         /* network byte order, 0 if unused */
+};
+
+static struct {
+    struct lease_binding *by_mac;   /* LEASE_TABLE_SZ, indexed by chaddr */
+    struct lease_binding *by_addr;  /* LEASE_TABLE_SZ, indexed by address */
+    uint64_t    bound;
+    uint64_t    moved;
+    uint64_t    released;
+} lease;
+
+static inline struct lease_binding *lease_by_mac(const uint8_t *mac)
+{
+    return &lease.by_mac[__murmur_hash64(mac, 6) & (LEASE_TABLE_SZ - 1)];
+}
+
+static inline struct lease_binding *lease_by_addr(uint32_t ip_addr)
+{
+    return &lease.by_addr[__murmur_hash64((uint8_t *) &ip_addr, sizeof(ip_addr)) &
+                          (LEASE_TABLE_SZ - 1)];
+}
+
+/*
+ * return 0 on success, -1 on failure.
+ */
+int lease_init(void)
+{
+    memset(&lease, 0, sizeof(lease));
+
+    lease.by_mac = calloc(LEASE_TABLE_SZ, sizeof(*lease.by_mac));
+    lease.by_addr = calloc(LEASE_TABLE_SZ, sizeof(*lease.by_addr));
+    if (lease.by_mac == NULL || lease.by_addr == NULL) {
+        fprintf(stderr, "ERROR: can't allocate DHCP lease table\n");
+        lease_exit();
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Record that the client of hardware address chaddr binds the IPv4 address
+ * ip_addr, in network byte order, and move its device there if it had
+ * another address.
+ *
+ * The function MUST be called from the packet dispatcher thread.
+ */
+void lease_bind(const uint8_t *chaddr, uint32_t ip_addr)
+{
+    struct lease_binding *binding = lease_by_mac(chaddr);
+    struct lease_binding *holder = lease_by_addr(ip_addr);
+    int moved = 0;
+
+    if (binding->ip && binding->ip != ip_addr && memcmp(binding->mac, chaddr, 6) == 0) {
+        struct lease_binding *previous = lease_by_addr(binding->ip);
+
+        if (previous->ip == binding->ip && memcmp(previous->mac, chaddr, 6) == 0) {
+            moved = pdi_device_table_move(binding->ip, ip_addr);
+            lease.moved += moved;
+            previous->ip = 0;
+            DBG_PRINTF_1("[dispatch thread] " MAC_FMT " moves from " IP4_FMT " to " IP4_FMT "%s\n",
+                         MAC_FMT_ARGS(*chaddr), IP4_FMT_ARGS(binding->ip), IP4_FMT_ARGS(ip_addr),
+                         moved ? "" : ", no device");
+        }
+    }
+
+    if (!moved && holder->ip == ip_addr && memcmp(holder->mac, chaddr, 6) != 0) {
+        lease.released += pdi_device_table_remove(ip_addr);
+    }
+
+    if (binding->ip != ip_addr) {
+        lease.bound++;
+    }
+    memcpy(binding->mac, chaddr, 6);
+    binding->ip = ip_addr;
+    memcpy(holder->mac, chaddr, 6);
+    holder->ip = ip_addr;
+}
+
+void lease_report(void)
+{
+    printf("DHCP leases: bound: %" PRIu64 ", devices moved: %" PRIu64
+           ", devices of previous holders released: %" PRIu64 "\n",
+           lease.bound, lease.moved, lease.released);
+}
+
+void lease_exit(void)
+{
+    free(lease.by_mac);
+    free(lease.by_addr);
+    memset(&lease, 0, sizeof(lease));
+}
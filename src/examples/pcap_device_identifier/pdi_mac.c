@@ -0,0 +1,171 @@
+/*
+  This file is a part of Qosmos Device Identification library
+
+  Copyright Qosmos Tech 2000-2018 - All rights reserved
+
+  This computer program and all its components are protected by
+  authors' rights and copyright law and by international treaties.
+  Any representation, reproduction, distribution or modification
+  of this program or any portion of it is forbidden without
+  Qosmos explicit and written agreement and may result in severe
+  civil and criminal penalties, and will be prosecuted
+  to the maximum extent possible under the law.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "pdi_common.h"
+#include "pdi_utils.h"
+#include "pdi_device.h"
+
+/*
+ * MAC address learning.
+ *
+ * The dispatcher learns the MAC address of each IPv4 address from the L2
+ * headers it already has at hand, so that devices get theirs without going
+ * through DPI:
+ * - the sender of ARP requests and replies, and the client of DHCP
+ *   requests and acknowledgements: bindings, recorded here, and attached
+ *   to the device of the address if there is one,
+ * - the Ethernet source of packets that were not routed, for devices that
+ *   have no address yet: that of routed packets is a router's.
+ * A device created after its address was bound gets the recorded address.
+ *
+ * Bindings live in a direct-mapped array indexed by address: a binding that
+ * takes the place of another only leaves its device to the Ethernet source.
+ * ARP and DHCP packets are easily forged: a binding a DHCP server
+ * acknowledged is only replaced by another acknowledged one, and changes
+ * of bindings are rate limited, see admission_learn_check(). Only
+ * acknowledged bindings spare their address the global creation rate.
+ *
+ * Only the dispatcher thread uses the bindings: they take no lock.
+ */
+
+#define MAC_TABLE_SZ    (1u << 16)
+
+struct mac_binding {
+    uint32_t    ip;         /* network byte order, 0 if unused */
+    uint8_t     mac[6];
+    uint8_t     acked;      /* from a DHCPACK */
+    uint8_t     reserved;
+};
+
+static struct {
+    struct mac_binding *binding;    /* MAC_TABLE_SZ */
+    uint64_t    learnt;
+    uint64_t    kept;       /* acknowledged bindings not replaced */
+    uint64_t    attached;
+} mac_table;
+
+static inline struct mac_binding *mac_binding(uint32_t ip_addr)
+{
+    return &mac_table.binding[__murmur_hash64((uint8_t *) &ip_addr, sizeof(ip_addr)) &
+                              (MAC_TABLE_SZ - 1)];
+}
+
+/*
+ * return 0 on success, -1 on failure.
+ */
+int mac_init(void)
+{
+    memset(&mac_table, 0, sizeof(mac_table));
+
+    mac_table.binding = calloc(MAC_TABLE_SZ, sizeof(*mac_table.binding));
+    if (mac_table.binding == NULL) {
+        fprintf(stderr, "ERROR: can't allocate MAC address table\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Record that the IPv4 address ip_addr, in network byte order, is bound to
+ * the MAC address mac, from ARP or DHCP, at packet time now, and set the
+ * address of its device if there is one. acked is set if the binding comes
+ * from a DHCPACK.
+ *
+ * The function MUST be called from the packet dispatcher thread.
+ */
+void mac_learn(uint32_t ip_addr, const uint8_t *mac, int acked, const struct timeval *now)
+{
+    struct mac_binding *binding = mac_binding(ip_addr);
+    device_ip_t *device = NULL;
+
+    if (binding->ip == ip_addr && memcmp(binding->mac, mac, 6) == 0 &&
+        binding->acked >= acked) {
+        return;
+    }
+
+    if (binding->ip && binding->acked && !acked) {
+        mac_table.kept++;
+        return;
+    }
+
+    if (!admission_learn_check(now)) {
+        return;
+    }
+
+    binding->ip = ip_addr;
+    memcpy(binding->mac, mac, 6);
+    binding->acked = acked;
+    mac_table.learnt++;
+
+    device = pdi_device_table_find(ip_addr);
+    if (device && pdi_device_set_mac(device, mac)) {
+        mac_table.attached++;
+        DBG_PRINTF_2("[dispatch thread] " IP4_FMT " is at " MAC_FMT "\n",
+                     IP4_FMT_ARGS(ip_addr), MAC_FMT_ARGS(*mac));
+    }
+}
+
+/*
+ * Set the MAC address of a device of address ip_addr that has none yet:
+ * the recorded binding of the address if any, otherwise eth_src, the
+ * Ethernet source of a packet of the device that was not routed, if not
+ * NULL.
+ *
+ * The function MUST be called from the packet dispatcher thread.
+ */
+void mac_attach(struct device_ip *device, uint32_t ip_addr, const uint8_t *eth_src)
+{
+    struct mac_binding *binding = mac_binding(ip_addr);
+    const uint8_t *mac = eth_src;
+
+    if (binding->ip == ip_addr) {
+        mac = binding->mac;
+    }
+
+    if (mac && pdi_device_set_mac(device, mac)) {
+        mac_table.attached++;
+    }
+}
+
+/*
+ * return 1 if a DHCP server acknowledged the binding of the IPv4 address
+ * ip_addr, in network byte order, 0 otherwise.
+ *
+ * The function MUST be called from the packet dispatcher thread.
+ */
+int mac_acked(uint32_t ip_addr)
+{
+    struct mac_binding *binding = mac_binding(ip_addr);
+
+    return binding->ip == ip_addr && binding->acked;
+}
+
+void mac_report(void)
+{
+    printf("MAC addresses: bindings learnt: %" PRIu64 ", acknowledged ones kept: %" PRIu64
+           ", attached to devices: %" PRIu64 "\n",
+           mac_table.learnt, mac_table.kept, mac_table.attached);
+}
+
+void mac_exit(void)
+{
+    free(mac_table.binding);
+    memset(&mac_table, 0, sizeof(mac_table));
+}
@@ -0,0 +1,298 @@
+/*
+  This file is a part of Qosmos Device Identification library
+
+  Copyright Qosmos Tech 2000-2018 - All rights reserved
+
+  This computer program and all its components are protected by
+  authors' rights and copyright law and by international treaties.
+  Any representation, reproduction, distribution or modification
+  of this program or any portion of it is forbidden without
+  Qosmos explicit and written agreement and may result in severe
+  civil and criminal penalties, and will be prosecuted
+  to the maximum extent possible under the law.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <arpa/inet.h>
+
+#include "pdi_common.h"
+#include "pdi_utils.h"
+
+/*
+ * Monitored address scope.
+ *
+ * Only addresses of the --monitor prefixes, all of them if there is none,
+ * and not in the --exclude prefixes may get a device. The longest matching
+ * prefix decides, an exclusion wins over a monitored prefix of the same
+ * length.
+ *
+ * Prefixes are compiled in a DIR-16-8-8 table: a first level of 2^16
+ * entries indexed by the top 16 bits of the address and, below prefixes
+ * longer than /16, groups of 256 entries indexed by the next 8 bits. An
+ * entry either holds the verdict or points to a group, so a lookup reads
+ * one entry, two for addresses under a /17 to /24 prefix and three under a
+ * longer one. The first level takes 128 KB and stays cache resident.
+ *
+ * The table is read-only once built: lookups are safe from any thread.
+ */
+
+#define SCOPE_L1_SHIFT  16
+#define SCOPE_L1_SZ     (1u << SCOPE_L1_SHIFT)
+#define SCOPE_GROUP_SZ  256
+#define SCOPE_GROUP     0x8000 /* entry points to group (entry & ~SCOPE_GROUP) */
+#define SCOPE_GROUP_MAX SCOPE_GROUP
+#define SCOPE_OUT       0
+#define SCOPE_IN        1
+
+struct scope_prefix {
+    uint32_t prefix;   /* host byte order */
+    uint8_t  len;
+    uint8_t  verdict;
+};
+
+static struct {
+    uint16_t *l1;       /* SCOPE_L1_SZ entries, NULL if every address is in scope */
+    uint16_t *group;    /* nb_groups * SCOPE_GROUP_SZ entries */
+    uint32_t  nb_groups;
+    uint32_t  size_groups;
+} scope;
+
+/*
+ * Shorter prefixes first, so that longer ones are painted over them, and
+ * exclusions after monitored prefixes of the same length.
+ */
+static int scope_prefix_cmp(const void *a, const void *b)
+{
+    const struct scope_prefix *pa = a;
+    const struct scope_prefix *pb = b;
+
+    if (pa->len != pb->len) {
+        return pa->len < pb->len ? -1 : 1;
+    }
+
+    return pa->verdict > pb->verdict ? -1 : pa->verdict < pb->verdict;
+}
+
+/*
+ * Parse comma separated prefixes and append them to *prefixes.
+ * return 0 on success, -1 on failure.
+ */
+static int scope_parse(const char *list, const char *name, uint8_t verdict,
+                       struct scope_prefix **prefixes, uint32_t *nb)
+{
+    char *str = NULL;
+    char *token = NULL;
+    char *saveptr = NULL;
+
+    if (list == NULL) {
+        return 0;
+    }
+
+    str = strdup(list);
+    if (str == NULL) {
+        fprintf(stderr, "ERROR: can't allocate %s prefixes\n", name);
+        return -1;
+    }
+
+    for (token = strtok_r(str, ",", &saveptr); token; token = strtok_r(NULL, ",", &saveptr)) {
+        struct scope_prefix *new_prefixes;
+        char *len_str = strchr(token, '/');
+        struct in_addr addr;
+        unsigned int len = 32;
+        char end;
+
+        if (len_str) {
+            *len_str++ = '\0';
+        }
+        if (inet_pton(AF_INET, token, &addr) != 1 ||
+            (len_str && (sscanf(len_str, "%u%c", &len, &end) != 1 || len > 32))) {
+            fprintf(stderr, "ERROR: invalid %s prefix %s%s%s, expected a.b.c.d[/len]\n",
+                    name, token, len_str ? "/" : "", len_str ? len_str : "");
+            free(str);
+            return -1;
+        }
+
+        new_prefixes = realloc(*prefixes, (*nb + 1) * sizeof(**prefixes));
+        if (new_prefixes == NULL) {
+            fprintf(stderr, "ERROR: can't allocate %s prefixes\n", name);
+            free(str);
+            return -1;
+        }
+        *prefixes = new_prefixes;
+        (*prefixes)[*nb].prefix = len ? ntohl(addr.s_addr) & (~0u << (32 - len)) : 0;
+        (*prefixes)[*nb].len = len;
+        (*prefixes)[*nb].verdict = verdict;
+        (*nb)++;
+    }
+
+    free(str);
+
+    return 0;
+}
+
+/*
+ * Make *entry point to a group, created with the verdict *entry held.
+ * return the group, NULL on failure.
+ */
+static uint16_t *scope_group(uint16_t *entry)
+{
+    uint16_t verdict = *entry;
+    uint32_t index;
+    uint32_t i;
+
+    if (verdict & SCOPE_GROUP) {
+        return &scope.group[(verdict & ~SCOPE_GROUP) * SCOPE_GROUP_SZ];
+    }
+
+    if (scope.nb_groups == scope.size_groups) {
+        fprintf(stderr, "ERROR: more than %u scope groups\n", scope.size_groups);
+        return NULL;
+    }
+
+    index = scope.nb_groups++;
+    *entry = SCOPE_GROUP | index;
+    for (i = 0; i < SCOPE_GROUP_SZ; i++) {
+        scope.group[index * SCOPE_GROUP_SZ + i] = verdict;
+    }
+
+    return &scope.group[index * SCOPE_GROUP_SZ];
+}
+
+/*
+ * Set the verdict of a prefix over the entries it covers.
+ * return 0 on success, -1 on failure.
+ */
+static int scope_paint(const struct scope_prefix *p)
+{
+    uint16_t *entry = &scope.l1[p->prefix >> SCOPE_L1_SHIFT];
+    uint16_t *group;
+    uint32_t first, nb;
+    uint32_t i;
+
+    /* Prefixes are painted shortest first: the entries a prefix covers only
+     * hold verdicts, groups are only created under longer prefixes. */
+    if (p->len <= SCOPE_L1_SHIFT) {
+        first = p->prefix >> SCOPE_L1_SHIFT;
+        nb = 1u << (SCOPE_L1_SHIFT - p->len);
+        for (i = 0; i < nb; i++) {
+            scope.l1[first + i] = p->verdict;
+        }
+        return 0;
+    }
+
+    group = scope_group(entry);
+    if (group == NULL) {
+        return -1;
+    }
+    if (p->len > 24) {
+        group = scope_group(&group[(p->prefix >> 8) & 0xff]);
+        if (group == NULL) {
+            return -1;
+        }
+        first = p->prefix & 0xff;
+        nb = 1u << (32 - p->len);
+    } else {
+        first = (p->prefix >> 8) & 0xff;
+        nb = 1u << (24 - p->len);
+    }
+
+    for (i = 0; i < nb; i++) {
+        group[first + i] = p->verdict;
+    }
+
+    return 0;
+}
+
+/*
+ * Build the scope of the --monitor and --exclude prefixes.
+ * return 0 on success, -1 on failure.
+ */
+int scope_init(const char *monitor, const char *exclude)
+{
+    struct scope_prefix *prefixes = NULL;
+    uint32_t nb_monitor = 0;
+    uint32_t nb = 0;
+    uint32_t i;
+    int ret = -1;
+
+    memset(&scope, 0, sizeof(scope));
+    if (monitor == NULL && exclude == NULL) {
+        return 0;
+    }
+
+    if (scope_parse(monitor, "monitor", SCOPE_IN, &prefixes, &nb) < 0) {
+        goto exit;
+    }
+    nb_monitor = nb;
+    if (scope_parse(exclude, "exclude", SCOPE_OUT, &prefixes, &nb) < 0) {
+        goto exit;
+    }
+
+    qsort(prefixes, nb, sizeof(*prefixes), scope_prefix_cmp);
+
+    /* A prefix longer than /16 needs up to two groups. */
+    scope.size_groups = nb * 2 < SCOPE_GROUP_MAX ? nb * 2 : SCOPE_GROUP_MAX;
+    scope.l1 = malloc(SCOPE_L1_SZ * sizeof(*scope.l1));
+    scope.group = malloc((size_t) scope.size_groups * SCOPE_GROUP_SZ * sizeof(*scope.group));
+    if (scope.l1 == NULL || (scope.size_groups && scope.group == NULL)) {
+        fprintf(stderr, "ERROR: can't allocate scope table\n");
+        goto exit;
+    }
+    /* Without monitored prefixes, everything not excluded is in scope. */
+    for (i = 0; i < SCOPE_L1_SZ; i++) {
+        scope.l1[i] = nb_monitor ? SCOPE_OUT : SCOPE_IN;
+    }
+
+    for (i = 0; i < nb; i++) {
+        if (scope_paint(&prefixes[i]) < 0) {
+            goto exit;
+        }
+    }
+
+    printf("Scope: %u monitored and %u excluded prefixes, %u groups, %zu KB\n",
+           nb_monitor, nb - nb_monitor, scope.nb_groups,
+           (SCOPE_L1_SZ + (size_t) scope.nb_groups * SCOPE_GROUP_SZ) * sizeof(uint16_t) / 1024);
+    ret = 0;
+
+exit:
+    free(prefixes);
+    if (ret < 0) {
+        scope_exit();
+    }
+
+    return ret;
+}
+
+/*
+ * return 1 if a device may be created for the IPv4 address ip_addr, in
+ * network byte order, 0 if it is out of scope.
+ */
+int scope_match(uint32_t ip_addr)
+{
+    uint32_t ip = ntohl(ip_addr);
+    uint16_t entry;
+
+    if (scope.l1 == NULL) {
+        return 1;
+    }
+
+    entry = scope.l1[ip >> SCOPE_L1_SHIFT];
+    if (entry & SCOPE_GROUP) {
+        entry = scope.group[(entry & ~SCOPE_GROUP) * SCOPE_GROUP_SZ + ((ip >> 8) & 0xff)];
+        if (entry & SCOPE_GROUP) {
+            entry = scope.group[(entry & ~SCOPE_GROUP) * SCOPE_GROUP_SZ + (ip & 0xff)];
+        }
+    }
+
+    return entry == SCOPE_IN;
+}
+
+void scope_exit(void)
+{
+    free(scope.l1);
+    free(scope.group);
+    memset(&scope, 0, sizeof(scope));
+}
@@ -19,20 +19,39 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <pthread.h>
+#include <time.h>
 #include <sys/queue.h>
 
+#include "qmdevice.h"
+
+/* Device state flags */
+#define DEVICE_STATE_IDENTIFIED  0x01 /* score and metadata are set */
+#define DEVICE_STATE_MAC_SENT    0x02 /* MAC fingerprint submitted */
+#define DEVICE_STATE_LINKED      0x04 /* in the device table */
+#define DEVICE_STATE_MAC_LEARNT  0x08 /* mac_addr is set, see pdi_mac.c */
+
+/*
+ * Identification details of a device. The address, state and last packet
+ * time the dispatcher needs are kept apart in the device table, see
+ * pdi_device.c.
+ */
 struct device_ip {
     SLIST_ENTRY(device_ip) next;
-    uint32_t               ip_addr;
     uint8_t                mac_addr[6];
-    uint8_t                is_identified:1;
-    uint8_t                mac_sent:1;
     unsigned int           score;
     unsigned int           flags;
     time_t                 detected_time;
-    char                   metadata[128];
+    /* Metadata value IDs, see qmdev_device_metadata_get_byid(). The OS
+     * version has none: its slot holds an interned string, see pdi_device.c. */
+    uint32_t               metadata_id[QMDEV_MAX_METADATA_ID];
     struct qmdev_device_context *device_context;
-    pthread_rwlock_t       rwlock;//read-write lock on device_ip struct
+    /* Fingerprints the device queue had no room for, see thread_fingerprint_queue(). */
+    struct qmdev_fingerprint_group *pending_fpg;
+    unsigned int           pending_fp;
+    /* Processed group, reset for the next fingerprints of the device. */
+    struct qmdev_fingerprint_group *spare_fpg;
+    STAILQ_ENTRY(device_ip) overflow_next;
+    LIST_ENTRY(device_ip)  wheel_next;  /* device table timing wheel */
 };
 
 #define ARRAY_SIZE(a) (sizeof(a)/sizeof(a[0]))
@@ -80,6 +99,15 @@ struct device_ip {
 
 #define DBG_GET_LEVEL()   (pdi_options.v)
 
+static inline uint64_t pdi_clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
 uint64_t __murmur_hash64(const uint8_t *data, unsigned long len) __attribute__((weak));
 uint64_t __murmur_hash64(const uint8_t *data, unsigned long len)
 {
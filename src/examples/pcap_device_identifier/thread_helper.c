@@ -22,15 +22,45 @@
 
 /* Qosmos ixEngine header */
 #include "qmdpi.h"
+#include "qmdevice.h"
 
 #include "pdi_common.h"
 #include "pdi_device.h"
 
 static struct pdi_thread dev_thread;
+
+struct pdi_fp_backlog_stats fp_backlog_stats;
 static unsigned int thread_num_dpi_worker;
 
-static pthread_barrier_t barrier;
-static pthread_barrier_t barrier_dev;
+/*
+ * Flow to DPI thread mapping.
+ *
+ * Only the first workers_active DPI threads get new flows. When this number
+ * changes, the generation is incremented: flows mapped by a previous
+ * generation stay on their DPI thread, which holds their ixEngine flow
+ * context, until they have been idle for FLOW_MAP_IDLE seconds.
+ * The map is only used when the number of DPI threads may change; it is
+ * owned by the dispatcher thread.
+ */
+#define FLOW_MAP_WAYS       4
+#define FLOW_MAP_HASHSZ     (1 << 16)
+#define FLOW_MAP_MASK       (FLOW_MAP_HASHSZ - 1)
+#define FLOW_MAP_IDLE       60
+
+struct flow_map_entry {
+    uint32_t hashkey;
+    uint32_t last_seen;
+    uint16_t worker;
+    uint16_t generation;
+};
+
+static struct flow_map_entry *flow_map;
+static unsigned int workers_active;
+static uint16_t workers_generation;
+static uint32_t dispatch_now;
+
+/* Number of DPI threads that have not yet passed the current epoch marker. */
+static unsigned int epoch_workers_left;
 
 /*
  * Initialize thread context
@@ -68,8 +98,12 @@ void thread_wait(unsigned int nb_workers)
             printf("ERROR pthread_join[%d] %d\n", i, ret);
         }
         pthread_mutex_destroy(&threads[i].lock);
+        pthread_cond_destroy(&threads[i].park_cond);
     }
 
+    free(flow_map);
+    flow_map = NULL;
+
     ret = pthread_join(dev_thread.handle, NULL);
     if (ret) {
         printf("ERROR pthread_join dev %d\n", ret);
@@ -92,34 +126,70 @@ void thread_stop(unsigned int nb_workers)
 }
 /*
  * Enqueue a fingerprint to be processed by the libdevice thread.
+ *
+ * The function never blocks: when the device queue is full, the group is
+ * parked in its device pending slot, where later fingerprints of the same
+ * device are merged, until the device thread catches up.
+ * If the device already has a pending group or the backlog budget is
+ * exhausted, the group is dropped.
+ * return 0 if the group has been queued or parked, -1 if it has been dropped.
  */
-void thread_fingerprint_queue(struct qmdev_fingerprint_group *fp_group)
+int thread_fingerprint_queue(struct pdi_thread *ctx,
+                             struct qmdev_fingerprint_group *fp_group)
 {
     if (fp_group == NULL) {
-        return ;
+        return -1;
+    }
+
+    if (thread_fifo_try_push(&device_queue, fp_group) == 0) {
+        __atomic_add_fetch(&fp_backlog_stats.queued, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    if (pdi_device_fingerprint_park(fp_group, ctx->fp_nb) == 0) {
+        __atomic_add_fetch(&fp_backlog_stats.parked, 1, __ATOMIC_RELAXED);
+
+        /* Make sure the device thread looks at pending slots even if it
+         * drains the queue meanwhile. If the queue is still full, it will
+         * do it after its next pop. */
+        thread_fifo_try_push(&device_queue, THREAD_OVERFLOW);
+        return 0;
     }
 
-    thread_fifo_push(&device_queue, fp_group);
+    __atomic_add_fetch(&fp_backlog_stats.shed, ctx->fp_nb, __ATOMIC_RELAXED);
+    qmdev_fingerprint_group_destroy(fp_group);
+
+    return -1;
 }
 
 /*
  * DPI and libdevice threads creation
+ *
+ * nb_workers DPI threads are created, only the first nb_active ones get
+ * packets. The others are parked until thread_workers_resize().
  */
-int thread_launch(unsigned int nb_workers, struct qmdpi_engine *engine)
+int thread_launch(unsigned int nb_workers, unsigned int nb_active,
+                  struct qmdpi_engine *engine)
 {
     int ret;
     unsigned int i;
 
     thread_num_dpi_worker = nb_workers;
+    workers_active = nb_active;
 
-    /* Initialise thread barriers for dpi threads and device thread. */
-    pthread_barrier_init(&barrier, NULL, nb_workers + 1);
-    pthread_barrier_init(&barrier_dev, NULL, 2);
+    if (nb_active < nb_workers) {
+        flow_map = calloc(FLOW_MAP_HASHSZ, sizeof(*flow_map));
+        if (flow_map == NULL) {
+            fprintf(stderr, "ERROR: can't allocate flow map, DPI threads fixed to %u.\n", nb_active);
+        }
+    }
 
     for (i = 0; i < nb_workers; ++i) {
         threads[i].thread_id = i;
         threads[i].worker = qmdpi_worker_create(engine);
+        threads[i].parked = threads[i].parked_ack = (i >= nb_active);
         pthread_mutex_init(&threads[i].lock, NULL);
+        pthread_cond_init(&threads[i].park_cond, NULL);
         ret = pthread_create(&threads[i].handle, NULL, dpi_processing_thread_main, &threads[i]);
         if (ret != 0) {
             fprintf(stderr, "ERROR: Starting dpi thread failed.\n");
@@ -141,46 +211,222 @@ int thread_launch(unsigned int nb_workers, struct qmdpi_engine *engine)
     return 0;
 }
 
-int thread_packet_loop_function(pcap_t *pcap, void *arg)
+/*
+ * Get the DPI thread of a flow.
+ * now is the packet timestamp in seconds.
+ *
+ * The function MUST be called from the packet dispatcher thread.
+ */
+struct pdi_thread *thread_dispatch_get(uint32_t hashkey, uint32_t now)
 {
-    return packet_dispatch_loop(pcap, arg);
+    struct flow_map_entry *set;
+    struct flow_map_entry *entry = NULL;
+    unsigned int i;
+
+    dispatch_now = now;
+
+    if (flow_map == NULL) {
+        return &threads[hashkey % workers_active];
+    }
+
+    set = &flow_map[hashkey & FLOW_MAP_MASK & ~(FLOW_MAP_WAYS - 1)];
+
+    for (i = 0; i < FLOW_MAP_WAYS; i++) {
+        if (set[i].hashkey == hashkey) {
+            entry = &set[i];
+            if (entry->generation == workers_generation ||
+                now - entry->last_seen < FLOW_MAP_IDLE) {
+                goto found;
+            }
+            break;
+        }
+        /*
+         * Otherwise replace the least recently seen flow that can do without
+         * its entry: idle, or mapped by this generation, which maps it again
+         * to the same DPI thread.
+         */
+        if (set[i].generation != workers_generation &&
+            now - set[i].last_seen < FLOW_MAP_IDLE) {
+            continue;
+        }
+        if (entry == NULL || set[i].last_seen < entry->last_seen) {
+            entry = &set[i];
+        }
+    }
+
+    if (entry == NULL) {
+        /*
+         * The set is full of active flows of previous generations: map this
+         * one without recording it, it stays on its DPI thread as long as
+         * the generation does not change.
+         */
+        return &threads[hashkey % workers_active];
+    }
+
+    entry->hashkey = hashkey;
+    entry->worker = hashkey % workers_active;
+    entry->generation = workers_generation;
+
+found:
+    entry->last_seen = now;
+    threads[entry->worker].last_dispatch = now;
+
+    return &threads[entry->worker];
 }
 
-void thread_synchronise(void)
+unsigned int thread_workers_active(void)
 {
-    pthread_barrier_wait(&barrier);
+    return workers_active;
 }
 
-void thread_synchronise_device(void)
+static void thread_worker_park(struct pdi_thread *thread, int parked)
 {
-    pthread_barrier_wait(&barrier_dev);
+    pthread_mutex_lock(&thread->lock);
+    thread->parked = parked;
+    if (!parked) {
+        thread->parked_ack = 0;
+        pthread_cond_signal(&thread->park_cond);
+    }
+    pthread_mutex_unlock(&thread->lock);
 }
 
 /*
- * Clean up devices table.
+ * Change the number of DPI threads getting new flows.
+ * Removed DPI threads keep their flows until they are idle, see
+ * thread_workers_drain().
  *
- * The function waits till all threads queues are empty AND
- * threads have finished their processing.
- * It sends pause message and waits they received the message.
+ * The function MUST be called from the packet dispatcher thread.
+ */
+void thread_workers_resize(unsigned int nb_active)
+{
+    unsigned int i;
+
+    if (flow_map == NULL || nb_active == 0 || nb_active > thread_num_dpi_worker ||
+        nb_active == workers_active) {
+        return;
+    }
+
+    for (i = workers_active; i < nb_active; i++) {
+        threads[i].last_dispatch = dispatch_now;
+        if (threads[i].parked) {
+            thread_worker_park(&threads[i], 0);
+        }
+    }
+
+    workers_active = nb_active;
+    workers_generation++;
+}
+
+/*
+ * Park DPI threads out of the active set once their flows are idle and
+ * their rings are empty.
  *
  * The function MUST be called from the packet dispatcher thread.
  */
-void remove_devices(void)
+void thread_workers_drain(void)
 {
     unsigned int i;
 
-    /* Pause DPI threads */
-    for(i = 0; i < thread_num_dpi_worker; i++) {
-        packet_queue(&threads[i], THREAD_PAUSE);
+    for (i = workers_active; i < thread_num_dpi_worker; i++) {
+        struct pdi_thread *th = &threads[i];
+
+        if (!th->parked &&
+            dispatch_now - th->last_dispatch >= FLOW_MAP_IDLE &&
+            th->read_index == th->write_index &&
+            th->prio_read_index == th->prio_write_index) {
+            thread_worker_park(th, 1);
+        }
+    }
+}
+
+/*
+ * Time spent by the device thread processing fingerprints.
+ */
+uint64_t thread_device_busy_get(void)
+{
+    return __atomic_load_n(&dev_thread.stats.busy_ns, __ATOMIC_RELAXED);
+}
+
+int thread_packet_loop_function(pcap_t *pcap, void *arg)
+{
+    return packet_dispatch_loop(pcap, arg);
+}
+
+/*
+ * Start a new reclamation epoch if devices are waiting to be freed.
+ *
+ * An epoch marker is queued behind the packets of every DPI ring. Rings are
+ * FIFO so once a DPI thread dequeues the marker, it no longer holds any packet
+ * referencing a device retired before the marker. The last DPI thread to pass
+ * the marker forwards it to the device thread, behind every fingerprint group
+ * queued so far, which then frees the retired devices.
+ *
+ * Only one epoch is in flight at a time. Devices retired meanwhile wait for
+ * the next call.
+ *
+ * The function MUST be called from the packet dispatcher thread.
+ */
+void thread_epoch_advance(void)
+{
+    unsigned int i;
+
+    if (!pdi_device_epoch_begin()) {
+        return;
+    }
+
+    __atomic_store_n(&epoch_workers_left, thread_num_dpi_worker, __ATOMIC_RELEASE);
+
+    for (i = 0; i < thread_num_dpi_worker; i++) {
+        packet_queue(&threads[i], THREAD_EPOCH);
+    }
+}
+
+/*
+ * Called by a DPI thread when it dequeues an epoch marker.
+ */
+void thread_epoch_worker_pass(void)
+{
+    if (__atomic_sub_fetch(&epoch_workers_left, 1, __ATOMIC_ACQ_REL) == 0) {
+        thread_fifo_push(&device_queue, THREAD_EPOCH);
     }
-    thread_synchronise();
+}
+
+/*
+ * Ask the device thread to save a device table snapshot every
+ * --device_snapshot_interval seconds of packet time. A snapshot that does
+ * not fit in the device queue is asked again on the next call.
+ *
+ * The function MUST be called from the packet dispatcher thread.
+ */
+void thread_snapshot_tick(time_t now)
+{
+    static time_t snapshot_next;
 
-    /* Pause device thread */
-    thread_fifo_push(&device_queue, THREAD_PAUSE);
-    thread_synchronise_device();
+    if (pdi_options.device_snapshot == NULL) {
+        return;
+    }
 
-    /* We are good to go ... */
-    pdi_device_remove_all();
+    if (snapshot_next == 0) {
+        snapshot_next = now + pdi_options.device_snapshot_interval;
+    } else if (now >= snapshot_next &&
+               thread_fifo_try_push(&device_queue, THREAD_SNAPSHOT) == 0) {
+        snapshot_next = now + pdi_options.device_snapshot_interval;
+    }
+}
+
+/*
+ * Clean up devices table.
+ *
+ * All devices are unlinked from the table and retired. Their memory and
+ * device contexts are freed by the device thread once every thread has
+ * moved past them, so packet processing goes on meanwhile.
+ *
+ * The function MUST be called from the packet dispatcher thread.
+ */
+void remove_devices(void)
+{
+    pdi_device_retire_all();
+    thread_epoch_advance();
 }
 
 /*
@@ -196,7 +442,7 @@ void packet_queue(struct pdi_thread *thread,
 {
     size_t next_index;
 
-    if (packet != NULL && packet != THREAD_PAUSE) {
+    if (packet != NULL && packet != THREAD_EPOCH) {
         packet->thread_id = thread->thread_id;
     }
 
@@ -218,11 +464,75 @@ void packet_queue(struct pdi_thread *thread,
      */
     pthread_mutex_lock(&thread->lock);
     thread->write_index = next_index;
+    if (thread->parked) {
+        /* Stop or epoch marker */
+        pthread_cond_signal(&thread->park_cond);
+    }
     pthread_mutex_unlock(&thread->lock);
+
+    thread->bulk_enqueued++;
+}
+
+/*
+ * Enqueue packet in thread priority lane.
+ * return 0 on success, -1 if the lane is full.
+ */
+static int packet_queue_prio(struct pdi_thread *thread,
+                             struct pdi_pkt *packet)
+{
+    size_t next_index;
+
+    next_index = PRIO_INDEX(thread->prio_write_index + 1);
+
+    if (next_index == thread->prio_read_index) {
+        return -1;
+    }
+
+    packet->thread_id = thread->thread_id;
+    thread->prio_packets[thread->prio_write_index] = packet;
+
+    pthread_mutex_lock(&thread->lock);
+    thread->prio_write_index = next_index;
+    pthread_mutex_unlock(&thread->lock);
+
+    return 0;
+}
+
+/*
+ * Enqueue packet in the priority lane if prio is set, in the bulk lane
+ * otherwise.
+ *
+ * A packet only goes to the priority lane once the DPI thread has dequeued
+ * every bulk packet previously queued for flows of the same bucket, so a
+ * flow packets are never reordered. When the priority lane is full, the
+ * packet falls back to the bulk lane.
+ *
+ * return 1 if the packet has been queued in the priority lane, 0 otherwise.
+ */
+int packet_queue_lane(struct pdi_thread *thread,
+                      struct pdi_pkt *packet,
+                      uint32_t hashkey,
+                      int prio)
+{
+    uint32_t *bulk_seq = &thread->flow_bulk_seq[FLOW_LANE_INDEX(hashkey)];
+
+    if (prio) {
+        uint32_t dequeued = __atomic_load_n(&thread->bulk_dequeued, __ATOMIC_ACQUIRE);
+
+        if ((int32_t) (dequeued - *bulk_seq) >= 0 &&
+            packet_queue_prio(thread, packet) == 0) {
+            return 1;
+        }
+    }
+
+    packet_queue(thread, packet);
+    *bulk_seq = thread->bulk_enqueued;
+
+    return 0;
 }
 
 /*
- * Dequeue packet in thread ring
+ * Dequeue packet in thread ring, priority lane first
  */
 struct pdi_pkt *packet_dequeue(struct pdi_thread *thread)
 {
@@ -230,7 +540,19 @@ struct pdi_pkt *packet_dequeue(struct pdi_thread *thread)
 
     pthread_mutex_lock(&thread->lock);
 
-    while (thread->read_index == thread->write_index) {
+    while (thread->read_index == thread->write_index &&
+           thread->prio_read_index == thread->prio_write_index) {
+        if (thread->parked) {
+            if (!thread->parked_ack) {
+                thread->parked_ack = 1;
+                pthread_mutex_unlock(&thread->lock);
+                return THREAD_PARK;
+            }
+            /* Sleep till the thread is back in the active set. */
+            pthread_cond_wait(&thread->park_cond, &thread->lock);
+            continue;
+        }
+
         /**
          * Let other threads go
          */
@@ -239,6 +561,14 @@ struct pdi_pkt *packet_dequeue(struct pdi_thread *thread)
         pthread_mutex_lock(&thread->lock);
     }
 
+    if (thread->prio_read_index != thread->prio_write_index) {
+        packet = thread->prio_packets[thread->prio_read_index];
+        thread->prio_read_index = PRIO_INDEX(thread->prio_read_index + 1);
+        pthread_mutex_unlock(&thread->lock);
+
+        return packet;
+    }
+
     packet = thread->packets[thread->read_index];
 
     /*
@@ -246,6 +576,7 @@ struct pdi_pkt *packet_dequeue(struct pdi_thread *thread)
      * barrier for packet coherency
      */
     thread->read_index = PACKET_INDEX(thread->read_index + 1);
+    __atomic_store_n(&thread->bulk_dequeued, thread->bulk_dequeued + 1, __ATOMIC_RELEASE);
     pthread_mutex_unlock(&thread->lock);
 
     return packet;
@@ -293,6 +624,31 @@ void thread_fifo_push(struct thread_fifo *fifo, void *ptr)
     pthread_mutex_unlock(&fifo->mutex);
 }
 
+/*
+ * Same as thread_fifo_push() but fails instead of waiting for room.
+ * return 0 on success, -1 if the FIFO is full.
+ */
+int thread_fifo_try_push(struct thread_fifo *fifo, void *ptr)
+{
+    size_t next_index;
+
+    pthread_mutex_lock(&fifo->mutex);
+
+    next_index = FIFO_INDEX(fifo->write_index + 1);
+    if (next_index == fifo->read_index) {
+        pthread_mutex_unlock(&fifo->mutex);
+        return -1;
+    }
+
+    fifo->data[fifo->write_index] = ptr;
+    fifo->write_index = next_index;
+
+    pthread_cond_broadcast(&fifo->not_empty);
+    pthread_mutex_unlock(&fifo->mutex);
+
+    return 0;
+}
+
 void *thread_fifo_pop(struct thread_fifo *fifo)
 {
     void *data;
@@ -313,6 +669,21 @@ void *thread_fifo_pop(struct thread_fifo *fifo)
     return data;
 }
 
+/*
+ * Number of elements in the FIFO. The value is only a hint as it may change
+ * as soon as the lock is released.
+ */
+size_t thread_fifo_depth(struct thread_fifo *fifo)
+{
+    size_t depth;
+
+    pthread_mutex_lock(&fifo->mutex);
+    depth = FIFO_INDEX(fifo->write_index - fifo->read_index);
+    pthread_mutex_unlock(&fifo->mutex);
+
+    return depth;
+}
+
 void thread_fifo_lock(struct thread_fifo *fifo)
 {
     pthread_mutex_lock(&fifo->mutex);